@@ -62,4 +62,75 @@ extern int clydefscore_node_read(u64 tid, u64 nid, u64 offset, u64 len, void *da
  *         for the data failed. 
  */
 extern int clydefscore_node_write(u64 tid, u64 nid, u64 offset, u64 len, void *data);
+
+struct clydefscore_tree_stat {
+	u64 nodes;	/* nodes in the tree */
+	u64 bytes;	/* bytes of node data held */
+	u32 depth;	/* levels from the root to the leaves */
+	u8 k;
+};
+
+/**
+ * Describe a tree. 
+ * Optional: callers look it up with symbol_get() and must cope 
+ * with a backend that doesn't export it. 
+ * @param tid the tree identifier 
+ * @param st filled in on success 
+ * @return 0 on success. -ENOENT if there is no such tree 
+ */
+extern int clydefscore_tree_stat(u64 tid, struct clydefscore_tree_stat *st);
+
+/**
+ * Step through the nodes of a tree in identifier order. 
+ * Optional, looked up with symbol_get() like clydefscore_tree_stat. 
+ * @param tid the tree identifier 
+ * @param after find the first node whose identifier is greater 
+ *        than this; 0 to start from the beginning
+ * @param nid filled in with that node's identifier 
+ * @param len filled in with the bytes of data the node holds 
+ * @return 0 on success, 1 if there are no more nodes, -ENOENT if 
+ *         there is no such tree
+ */
+extern int clydefscore_node_next(u64 tid, u64 after, u64 *nid, u64 *len);
+
+/*
+ * Asynchronous variants of node_read, node_write and node_insert. 
+ * Optional, looked up with symbol_get() like clydefscore_tree_stat. 
+ * Each takes the arguments of its synchronous twin plus a completion: 
+ * a return of 0 means the operation was accepted and done(priv, err) 
+ * will be called exactly once when it finishes, with err as the 
+ * synchronous call would have returned it; done runs in process 
+ * context and may be called before the submitting call returns. 
+ * Any other return means the operation was not started and done 
+ * will not be called. 
+ *  
+ * Operations on the same node take effect in the order they were 
+ * submitted, and buffers must stay valid until done is called. 
+ */
+typedef void (*clydefscore_done_t)(void *priv, int err);
+
+/**
+ * Asynchronous clydefscore_node_read. 
+ * @return 0 if done will be called, negative if the read wasn't 
+ *         started
+ */
+extern int clydefscore_node_read_async(u64 tid, u64 nid, u64 offset, u64 len, void *data,
+                                       clydefscore_done_t done, void *priv);
+
+/**
+ * Asynchronous clydefscore_node_write. 
+ * @return 0 if done will be called, negative if the write wasn't 
+ *         started
+ */
+extern int clydefscore_node_write_async(u64 tid, u64 nid, u64 offset, u64 len, void *data,
+                                        clydefscore_done_t done, void *priv);
+
+/**
+ * Asynchronous clydefscore_node_insert. 
+ * @param nid filled in before done is called 
+ * @return 0 if done will be called, negative if the insert 
+ *         wasn't started
+ */
+extern int clydefscore_node_insert_async(u64 tid, u64 *nid,
+                                         clydefscore_done_t done, void *priv);
 #endif //__CLYDEINTERFACE_H
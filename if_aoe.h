@@ -20,6 +20,7 @@ enum {
 	AOEERR_DEV,
 	AOEERR_CFG,
 	AOEERR_VER,
+	AOEERR_BUSY = AOEERR_DEV,	/* no room for it now; an error report, not backpressure */
 
 	AOEFL_RSP = 1<<3,
 	AOEFL_ERR = 1<<2,
@@ -67,6 +68,172 @@ struct aoe_datahdr {
     unsigned char data[0];
 };
 
+/*
+ * Tree commands, framed.  Unlike aoe_treehdr above, which is host endian
+ * and kept only for existing clients, everything here is packed and big
+ * endian.  A frame is an aoe_treeh followed by nops operations back to
+ * back.  Each operation is an aoe_treeop followed by len bytes of data;
+ * only update requests and read replies carry data.  Errors come back in
+ * err as a negated errno or a positive backend status code.
+ *
+ * The ops in a frame run in order.  The reply holds one op for each op
+ * that ran, which is fewer than asked for if the reply frame filled up or
+ * TREEFL_STOPERR was set and an op failed.
+ *
+ * Frames are ordered against each other only by the node of their first
+ * op.  Commands for one node run in the order they arrive, but the later
+ * ops of a frame may run before or after other frames' ops on their
+ * nodes.  A client that needs two nodes changed in a fixed order against
+ * other traffic must wait for one reply before sending the next frame,
+ * or lead every frame touching them with an op on the same node.
+ */
+enum {
+	AOECMD_TREE = 0xfe,	/* vendor specific, clear of <linux/tree.h> */
+
+	TREE_VER = 1,
+
+	TREEFL_STOPERR = 1<<0,	/* aoe_treeh: stop at the first failed op */
+	TREEFL_STREAM = 1<<1,	/* aoe_treeh: a lone SCAN may answer in many frames */
+
+	TREEOPFL_MORE = 1<<0,	/* aoe_treeop reply: SCAN can go on from nid */
+	TREEOPFL_LZ4 = 1<<1,	/* aoe_treeop: READ reply or UPDATE data is lz4 */
+
+	TREEOP_CREATE = 1,	/* tid returned */
+	TREEOP_REMOVETREE,
+	TREEOP_READ,
+	TREEOP_INSERT,		/* nid returned */
+	TREEOP_UPDATE,
+	TREEOP_REMOVE,
+	TREEOP_STAT,		/* aoe_treestat returned as data */
+	TREEOP_COPY,		/* aoe_treecopy as data, see below */
+	TREEOP_SCAN,		/* aoe_treerecs returned as data */
+	TREEOP_MGET,		/* aoe_treegets as data, aoe_treerecs returned */
+
+	TREE_KMAX = 255,
+};
+
+/*
+ * TREEOPFL_LZ4 on a READ says the client can take the reply compressed,
+ * and then len may be more than the frame holds, up to 64k.  The target
+ * sets the flag on the reply if it did compress, with len the compressed
+ * size.  On an UPDATE it says the data is compressed; a target that
+ * can't decompress answers -EOPNOTSUPP and the client sends it plain.
+ */
+
+/*
+ * TREEOP_CREATE takes the tree's k-value in off, 0 for the target's
+ * default.  TREEOP_STAT answers with this as its data.  When the backend
+ * can't describe the tree itself, depth is 0 and nodes and bytes are what
+ * kvblade has seen inserted and written since it was loaded.
+ */
+struct aoe_treestat {
+	__be64 nodes;
+	__be64 bytes;
+	__be32 depth;
+	unsigned char k;
+	unsigned char res[3];
+} __attribute__ ((packed));
+
+/*
+ * TREEOP_COPY copies len bytes at off from node (tid, nid) to the same
+ * place in the node its data names, without the bytes leaving the target.
+ */
+struct aoe_treecopy {
+	__be64 tid;
+	__be64 nid;
+} __attribute__ ((packed));
+
+/*
+ * TREEOP_SCAN lists the nodes of tid after the cursor in nid, at most off
+ * of them (0 for as many as fit), each with up to len bytes of its data.
+ * The reply's nid is the cursor to carry on from, its off the number of
+ * records, its len their total size, and TREEOPFL_MORE is set unless the
+ * scan reached the end of the tree.  With TREEFL_STREAM on the frame the
+ * target keeps going in further reply frames, under the same tag, until
+ * off records in all, the end, or TREESCAN_FRAMES frames.
+ *
+ * TREEOP_MGET reads several nodes of tid at once, one aoe_treeget each.
+ * Its reply holds a record for as many as fit, in order, with off set to
+ * how many; the client asks again for the rest.
+ */
+enum {
+	TREESCAN_FRAMES = 64,
+};
+
+struct aoe_treeget {
+	__be64 nid;
+	__be32 off;
+	__be32 len;
+} __attribute__ ((packed));
+
+struct aoe_treerec {
+	__be64 nid;
+	__be32 len;		/* bytes in the node (scan), asked for (mget) */
+	__be32 dlen;		/* bytes of data that follow */
+	__be16 err;
+	unsigned char res[2];
+	unsigned char data[0];
+} __attribute__ ((packed));
+
+struct aoe_treeh {
+	unsigned char ver;
+	unsigned char flags;
+	__be16 nops;
+	unsigned char data[0];
+} __attribute__ ((packed));
+
+struct aoe_treeop {
+	unsigned char op;
+	unsigned char flags;
+	__be16 err;
+	__be32 len;
+	__be32 off;
+	__be64 tid;
+	__be64 nid;
+	unsigned char data[0];
+} __attribute__ ((packed));
+
+/*
+ * Copy offload, vendor specific too.  COPYOP_START copies cnt sectors
+ * from src_lba of target src_major.src_minor, which must be exported
+ * on the interface the frame came in on, to lba of the target the frame
+ * is addressed to.  The reply comes
+ * at once with an id and the copy carries on in the background.
+ * COPYOP_STATUS and COPYOP_CANCEL take that id and answer with how far
+ * the copy has got.  When it ends the target sends the initiator a
+ * COPYOP_STATUS reply unasked, under the tag of the START.  err is a
+ * negated errno once state is COPYST_FAILED.
+ */
+enum {
+	AOECMD_COPY = 0xfd,
+
+	COPY_VER = 1,
+
+	COPYOP_START = 1,
+	COPYOP_STATUS,
+	COPYOP_CANCEL,
+
+	COPYST_RUNNING = 0,
+	COPYST_DONE,
+	COPYST_FAILED,
+	COPYST_CANCELLED,
+};
+
+struct aoe_copyh {
+	unsigned char ver;
+	unsigned char op;
+	unsigned char state;
+	unsigned char src_minor;
+	__be16 src_major;
+	__be16 res;
+	__be32 id;
+	__be32 err;
+	__be64 src_lba;
+	__be64 lba;
+	__be64 cnt;
+	__be64 done;		/* sectors copied so far */
+} __attribute__ ((packed));
+
 struct aoe_cfghdr {
 	__be16 bufcnt;
 	__be16 fwver;
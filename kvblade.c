@@ -6,17 +6,34 @@
 #include <linux/workqueue.h>
 #include <linux/blkdev.h>
 #include <linux/netdevice.h>
+#include <linux/etherdevice.h>
 #include <linux/fs.h>
 #include <linux/namei.h>
 #include <linux/delay.h>
 #include <linux/kthread.h>
+#include <linux/interrupt.h>
 #include <linux/ata.h>
 #include <linux/ctype.h>
 #include <linux/kern_levels.h>
 #include <linux/tree.h>
 #include <linux/delay.h>
+#include <linux/random.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/radix-tree.h>
+#include <linux/highmem.h>
+#include <linux/file.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/crypto.h>
 #include "if_aoe.h"
 #include "clydeinterface.h"
+#include "kvblade_capture.h"
+
+#define CREATE_TRACE_POINTS
+#include "kvblade_trace.h"
 
 typedef enum {
     INCOMING = 1,
@@ -31,38 +48,119 @@ struct aoedev;
 #define dprintk(fmt, arg...) if(0);else xprintk(KERN_DEBUG, fmt, ## arg)
 
 struct tree_work {
-    struct work_struct work;
+    struct list_head list;  /*on its treeq*/
     struct aoedev *d;
     struct sk_buff *rskb;
+    int rlen;               /*bytes of the request, rskb is as long as the MTU*/
+    u64 tid, nid;           /*for a command the backend runs asynchronously*/
+};
+
+/*
+ * Tree commands are hashed on the (tid, nid) they touch to one of NTREEQ
+ * ordered queues, each drained by a single work item that always runs on
+ * the same CPU.  Commands for a node therefore run one at a time and in
+ * arrival order, while different nodes proceed in parallel and a hot
+ * node stays in one CPU's cache.  A frame of several ops is queued by
+ * its first op, so it is ordered only against that op's node.  When the
+ * backend runs a command asynchronously it counts as run once submitted;
+ * the backend keeps submission order per node from there.
+ */
+struct treeq {
+    spinlock_t lock;
+    struct list_head list;
+    struct work_struct work;
+    int cpu;
 };
 
 static struct workqueue_struct *tree_wq = NULL;
+static struct workqueue_struct *file_wq = NULL;
 static struct kmem_cache *tw_pool = NULL;
+static struct kmem_cache *tag_pool = NULL;
+
+/*
+ * Frame counters, kept per CPU so the hot paths never share a cache line
+ * and summed when read.  The timer works out per-second rates and, if
+ * stats_interval is set, logs them every that many seconds.
+ */
+enum {
+    STAT_RX,		/* frames queued for the kthread */
+    STAT_TX,
+    STAT_ATA,
+    STAT_CFG,
+    STAT_TREE,
+    STAT_COPY,
+    STAT_DUPDROP,	/* retransmits dropped while still in flight */
+    STAT_REPLAY,	/* retransmits answered from the reply ring */
+    STAT_QDROP,		/* dropped on arrival, inbound queues too long */
+    STAT_BUSY,		/* dropped, no request slot or memory to serve it */
+    STAT_NOREQ,		/* ATA request table full */
+    STAT_NOMEM,		/* allocation failed on the way to serving */
+    STAT_ZERO,		/* zero writes done without sending the zeros */
+    STAT_SPARSE,	/* answered from a target's allocation bitmap */
+    NSTATS,
+};
 
-struct counter {
-    /*rollover every 1k*/
-    unsigned long count;
-    /*incremented at every rollover*/
-    unsigned long kcount;
+static const char *statnames[NSTATS] = {
+    [STAT_RX] = "rx",
+    [STAT_TX] = "tx",
+    [STAT_ATA] = "ata",
+    [STAT_CFG] = "cfg",
+    [STAT_TREE] = "tree",
+    [STAT_COPY] = "copy",
+    [STAT_DUPDROP] = "dupdrop",
+    [STAT_REPLAY] = "replay",
+    [STAT_QDROP] = "qdrop",
+    [STAT_BUSY] = "busy",
+    [STAT_NOREQ] = "noreq",
+    [STAT_NOMEM] = "nomem",
+    [STAT_ZERO] = "zero",
+    [STAT_SPARSE] = "sparse",
 };
 
-struct counter mycounter;
+struct kvstats {
+    u64 n[NSTATS];
+};
+
+static DEFINE_PER_CPU(struct kvstats, kvstats);
+static u64 stat_last[NSTATS], stat_rate[NSTATS];
 
-static __always_inline void count_inc(struct counter *c)
+static unsigned int stats_interval;
+module_param(stats_interval, uint, 0644);
+MODULE_PARM_DESC(stats_interval, "seconds between rate reports in the kernel log, 0 for none");
+
+static __always_inline void stat_inc(int i)
 {
-    if ( unlikely(++c->count == 1000) ){
-        c->count = 0;
-        c->kcount++;
-    }
+    this_cpu_inc(kvstats.n[i]);
+}
+
+static u64 stat_read(int i)
+{
+    u64 n = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        n += per_cpu(kvstats, cpu).n[i];
+    return n;
 }
 
 static struct timer_list tmr;
 static void tmr_cb(unsigned long data) {
-    printk("kvblade (inc packets): %luk, %lu\n", mycounter.kcount, mycounter.count);
-    /*restart in 10 secs*/
-    if ( mod_timer(&tmr, jiffies + msecs_to_jiffies(10000)) ) {
-        printk("error initialising timer (mod_timer)\n");
+    static unsigned int ticks;
+    u64 n;
+    int i;
+
+    for (i = 0; i < NSTATS; i++) {
+        n = stat_read(i);
+        stat_rate[i] = n - stat_last[i];
+        stat_last[i] = n;
     }
+    if (stats_interval && ++ticks >= stats_interval) {
+        ticks = 0;
+        printk(KERN_INFO "kvblade: rx %llu/s tx %llu/s ata %llu/s tree %llu/s dupdrop %llu/s\n",
+            stat_rate[STAT_RX], stat_rate[STAT_TX], stat_rate[STAT_ATA],
+            stat_rate[STAT_TREE], stat_rate[STAT_DUPDROP]);
+    }
+    mod_timer(&tmr, jiffies + HZ);
 }
 
 
@@ -84,6 +182,8 @@ static void tmr_cb(unsigned long data) {
 	        return "AOECMD_UPDATENODE";
 	    case AOECMD_REMOVENODE:
 	        return "AOECMD_REMOVENODE";
+	    case AOECMD_TREE:
+	        return "AOECMD_TREE";
 	    default:
 	        return "UNKNOWN_TREE_CMD";
 	    }
@@ -124,21 +224,133 @@ static struct kobject kvblade_kobj;
 enum {
 	ATA_MODEL_LEN =	40,
 	ATA_LBA28MAX = 0x0fffffff,
+
+	NTAGHASH = 64,		/* in-flight tag buckets, power of 2 */
+	NRECENT = 16,		/* completed replies kept for retransmits */
+	TAG_STALE = 60 * HZ,	/* give up on an in-flight tag after this */
+
+	NFLOWS = 256,		/* inbound queues, hashed by initiator and target */
+	FQ_FLOWMAX = 512,	/* most frames one inbound queue holds */
+	FQ_QUANTUM = 9216,	/* bytes of credit per round, one jumbo frame */
+
+	NREQS = 128,		/* most ATA requests a target will hold */
+	BUFCNT_MIN = 4,
+	BUFCNT_INIT = 16,
+	ANNOUNCE_BURST = 16,	/* CFG announcements sent per jiffy */
+	CFG_BURST = 32,		/* broadcast CFG responses sent per jiffy */
+	NPATHS = 8,		/* interfaces one target can be exported on */
+
+	TREE_KDEFAULT = 10,
+	NTREEQ = 64,		/* ordered tree command queues, power of 2 */
+	TREECOPY_CHUNK = 65536,	/* bytes per step of a node copy */
+	TREELZ4_MAX = 65536,	/* most node bytes one compressed op moves */
+	TREELZ4_BUF = TREELZ4_MAX + TREELZ4_MAX/255 + 16,	/* lz4's worst case */
+
+	NCOPIES = 16,		/* LBA copies running at once */
+	COPY_PAGES = 64,	/* pages per step of an LBA copy */
+	COPY_KEEP = 60 * HZ,	/* how long a finished copy can be asked about */
+	NTREEHASH = 256,	/* tree stats buckets, power of 2 */
+	SPARSE_SHIFT = 7,	/* sectors per allocation bitmap bit, as a shift */
+};
+
+enum {
+	TAG_NEW,
+	TAG_INFLIGHT,
+	TAG_REPLAYED,
+};
+
+/* what a target's sectors live on */
+enum {
+	BE_BDEV,
+	BE_RAM,
+	BE_FILE,
+};
+
+/* a request we are still working on, keyed by initiator and tag */
+struct aoetag {
+	struct hlist_node node;
+	unsigned long started;
+	__be32 tag;
+	unsigned char addr[ETH_ALEN];
+};
+
+struct aoerecent {
+	struct sk_buff *skb;	/* clone of the reply we sent */
+	__be32 tag;
+	unsigned char addr[ETH_ALEN];
+};
+
+/*
+ * Inbound frames are spread over NFLOWS queues by (initiator, target) and
+ * served deficit round robin, so one busy initiator can't starve the rest.
+ */
+struct aoeflow {
+	struct list_head active;	/* on fq_active while backlogged */
+	struct sk_buff_head q;
+	int deficit;
+};
+
+/* token bucket; rate is per second, 0 for no limit */
+struct tbucket {
+	u64 rate;
+	s64 tokens;
+	unsigned long stamp;
 };
 
 struct aoereq {
 	struct bio *bio;
+	struct work_struct work;	/* BE_FILE, see file_work */
+	int rw;
+	sector_t lba;
+	atomic_t pending;	/* trim bios outstanding, plus one */
+	int error;
+	int zero;		/* BE_FILE write of zeros, punched instead */
 	struct sk_buff *skb;
+	ktime_t start;
 	struct aoedev *d;	/* blech.  I'm blind to a cleaner solution. */
 };
 
+/* an interface a target is exported on */
+struct aoepath {
+	struct net_device *nd;
+	struct sk_buff *cfgskb;	/* cached CFG response, see cfg_cached */
+	unsigned int cfgmtu;	/* the mtu cfgskb was built for */
+};
+
+/*
+ * A target is one backing device with one request pool and one config
+ * string, answering on up to NPATHS interfaces.  Replies go out on the
+ * interface the request came in on.  netdev is the interface the target
+ * was added on and is named after; it is always paths[0].
+ */
 struct aoedev {
 	struct kobject kobj;
 	struct aoedev *next;
 	struct net_device *netdev;
-	struct block_device *blkdev;
-	struct aoereq reqs[16];
+	struct aoepath paths[NPATHS];	/* changed under lock */
+	int npaths;
+	int backend;
+	struct block_device *blkdev;	/* BE_BDEV */
+	struct radix_tree_root ram;	/* BE_RAM, pages by index */
+	spinlock_t ram_lock;
+	unsigned long rampages;
+	struct file *filp;		/* BE_FILE */
+	unsigned long *alloc;	/* see sparse_any; changed under lock */
+	int alloc_ready;
+	struct aoereq reqs[NREQS];
 	atomic_t busy;
+	int bufcnt;		/* advertised in CFG, adjusted by bufcnt_work */
+	int peak;		/* most requests outstanding this period */
+	atomic_t ncomplete;	/* ATA completions this period */
+	u32 lat8;		/* ATA completion latency EWMA, usecs << 3 */
+	int tree_k;		/* k for trees created without one */
+	int announce;		/* announce_work still has to announce us */
+	spinlock_t tag_lock;	/* taken from bio completion, irqsave */
+	struct hlist_head tags[NTAGHASH];
+	struct aoerecent recent[NRECENT];
+	int nextrecent;
+	struct tbucket iops;	/* under fq_lock */
+	struct tbucket bw;
 	unsigned char config[1024];
 	int nconfig;
 	int major;
@@ -156,53 +368,460 @@ struct kvblade_sysfs_entry {
 	ssize_t (*store)(struct aoedev *, const char *, size_t);
 };
 
-static struct sk_buff_head skb_outq, skb_inq;
+static struct sk_buff_head skb_outq;
+static struct aoeflow flows[NFLOWS];
+static LIST_HEAD(fq_active);
+static spinlock_t fq_lock;
 static spinlock_t lock;
 static struct aoedev *devlist;
 static struct completion ktrendez;
 static struct task_struct *task;
 static wait_queue_head_t ktwaitq;
 
-static struct sk_buff *treecmd(struct aoedev *d, struct sk_buff *skb);
+static struct sk_buff *treecmd(struct aoedev *d, struct sk_buff *skb, int rlen);
+static int tree_async(struct tree_work *tw);
+
+/*
+ * Replies go out through the kthread by default.  With direct_xmit a
+ * finished I/O sends its own reply: at once when it completes in process
+ * or softirq context, otherwise through a per-CPU batch that a tasklet
+ * flushes, since dev_queue_xmit can't be called from a hard interrupt.
+ */
+static bool direct_xmit;
+module_param(direct_xmit, bool, 0644);
+MODULE_PARM_DESC(direct_xmit, "send replies from the I/O completion instead of the kthread");
+
+struct xmitq {
+	struct sk_buff_head q;
+	struct tasklet_struct tasklet;
+};
+
+static DEFINE_PER_CPU(struct xmitq, xmitqs);
+
+/*
+ * The capture ring; see kvblade_capture.h.  It is allocated at load when
+ * capture_records asks for it and records only while capture_on is set,
+ * so it costs nothing unless someone is looking.
+ */
+static unsigned int capture_records;
+module_param(capture_records, uint, 0444);
+MODULE_PARM_DESC(capture_records, "frames the debugfs capture ring holds, 0 for no ring");
+
+enum { CAPTURE_MAX = 1<<20 };
+
+static struct kvcap_hdr *cap;
+static struct kvcap_rec *caprecs;
+static size_t capsize;
+static u32 capture_on;
+static atomic64_t cap_head;
+static struct dentry *cap_dir;
+
+static void capture(struct sk_buff *skb, int dir)
+{
+	struct kvcap_rec *r;
+	u64 i;
+
+	if (!ACCESS_ONCE(capture_on) || !cap)
+		return;
+	i = atomic64_inc_return(&cap_head) - 1;
+	r = &caprecs[i & (cap->nrec - 1)];
+	r->seq = 0;
+	smp_wmb();
+	r->ns = ktime_to_ns(ktime_get());
+	r->len = skb->len;
+	r->dir = dir;
+	r->caplen = min_t(unsigned int, skb->len, KVCAP_SNAP);
+	r->ifindex = skb->dev->ifindex;
+	memcpy(r->data, skb_mac_header(skb), r->caplen);
+	smp_wmb();
+	r->seq = i + 1;
+	cap->head = i + 1;
+}
+
+static int capture_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, cap, vma->vm_pgoff);
+}
+
+static const struct file_operations capture_fops = {
+	.owner = THIS_MODULE,
+	.mmap = capture_mmap,
+};
+
+static void capture_init(void)
+{
+	u32 nrec;
+
+	if (!capture_records)
+		return;
+	nrec = roundup_pow_of_two(min_t(u32, capture_records, CAPTURE_MAX));
+	capsize = PAGE_SIZE + PAGE_ALIGN(nrec * sizeof(struct kvcap_rec));
+	cap = vmalloc_user(capsize);
+	if (!cap) {
+		eprintk("no memory for a capture ring of %u frames\n", nrec);
+		return;
+	}
+	cap->magic = KVCAP_MAGIC;
+	cap->ver = KVCAP_VER;
+	cap->nrec = nrec;
+	cap->recsize = sizeof(struct kvcap_rec);
+	caprecs = (struct kvcap_rec *) ((char *) cap + PAGE_SIZE);
+
+	cap_dir = debugfs_create_dir("kvblade", NULL);
+	if (IS_ERR_OR_NULL(cap_dir) ||
+		!debugfs_create_file("capture", 0400, cap_dir, NULL, &capture_fops) ||
+		!debugfs_create_bool("capture_on", 0600, cap_dir, &capture_on)) {
+		eprintk("can't publish the capture ring in debugfs\n");
+		if (!IS_ERR_OR_NULL(cap_dir))
+			debugfs_remove_recursive(cap_dir);
+		cap_dir = NULL;
+		vfree(cap);
+		cap = NULL;
+	}
+}
+
+/* after the last frame has gone out */
+static void capture_exit(void)
+{
+	debugfs_remove_recursive(cap_dir);
+	vfree(cap);
+}
+
+static void kvblade_xmit(struct sk_buff *skb)
+{
+	capture(skb, KVCAP_TX);
+	stat_inc(STAT_TX);
+	trace_kvblade_xmit(skb);
+	dev_queue_xmit(skb);
+}
+
+static void xmitq_flush(unsigned long data)
+{
+	struct xmitq *xq = (struct xmitq *) data;
+	struct sk_buff_head batch;
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	__skb_queue_head_init(&batch);
+	local_irq_save(flags);
+	skb_queue_splice_init(&xq->q, &batch);
+	local_irq_restore(flags);
+	while ((skb = __skb_dequeue(&batch)))
+		kvblade_xmit(skb);
+}
+
+/* send a finished reply, from wherever it finished */
+static void reply_xmit(struct sk_buff *skb)
+{
+	struct xmitq *xq;
+	unsigned long flags;
+
+	if (!direct_xmit) {
+		skb_queue_tail(&skb_outq, skb);
+		wake_up(&ktwaitq);
+	} else if (!in_irq() && !irqs_disabled()) {
+		kvblade_xmit(skb);
+	} else {
+		local_irq_save(flags);
+		xq = this_cpu_ptr(&xmitqs);
+		__skb_queue_tail(&xq->q, skb);
+		tasklet_schedule(&xq->tasklet);
+		local_irq_restore(flags);
+	}
+}
+
+static void xmitq_init(void)
+{
+	struct xmitq *xq;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		xq = per_cpu_ptr(&xmitqs, cpu);
+		__skb_queue_head_init(&xq->q);
+		tasklet_init(&xq->tasklet, xmitq_flush, (unsigned long) xq);
+	}
+}
+
+static void xmitq_exit(void)
+{
+	struct xmitq *xq;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		xq = per_cpu_ptr(&xmitqs, cpu);
+		tasklet_kill(&xq->tasklet);
+		__skb_queue_purge(&xq->q);
+	}
+}
+
+static int bufcnt_lat_us = 5000;
+module_param(bufcnt_lat_us, int, 0644);
+MODULE_PARM_DESC(bufcnt_lat_us, "ATA completion latency above which targets advertise fewer buffers");
+
+/*
+ * Initiators retransmit with the same tag when we are slow to answer.
+ * Each target remembers the (initiator, tag) pairs it is working on so
+ * that a retransmit doesn't put the same I/O on the disk twice, and keeps
+ * clones of the last few replies so that a retransmit arriving after
+ * completion can be answered without redoing the work.
+ */
+static __always_inline struct hlist_head *tag_bucket(struct aoedev *d, unsigned char *addr, __be32 tag)
+{
+	return &d->tags[jhash(addr, ETH_ALEN, (__force u32) tag) & (NTAGHASH-1)];
+}
+
+static struct aoetag *tag_find(struct aoedev *d, unsigned char *addr, __be32 tag)
+{
+	struct aoetag *t;
+
+	hlist_for_each_entry(t, tag_bucket(d, addr, tag), node)
+		if (t->tag == tag && memcmp(t->addr, addr, ETH_ALEN) == 0)
+			return t;
+	return NULL;
+}
+
+static int tag_begin(struct aoedev *d, unsigned char *addr, __be32 tag)
+{
+	struct aoerecent *r, *e;
+	struct sk_buff *skb;
+	struct aoetag *t;
+	ulong flags;
+
+	spin_lock_irqsave(&d->tag_lock, flags);
+
+	t = tag_find(d, addr, tag);
+	if (t) {
+		if (time_before(jiffies, t->started + TAG_STALE)) {
+			spin_unlock_irqrestore(&d->tag_lock, flags);
+			return TAG_INFLIGHT;
+		}
+		/* the original was lost somewhere; let this one through */
+		t->started = jiffies;
+		spin_unlock_irqrestore(&d->tag_lock, flags);
+		return TAG_NEW;
+	}
+
+	r = d->recent;
+	e = r + nelem(d->recent);
+	for (; r<e; r++)
+		if (r->skb && r->tag == tag && memcmp(r->addr, addr, ETH_ALEN) == 0)
+			break;
+	if (r < e) {
+		skb = skb_clone(r->skb, GFP_ATOMIC);
+		spin_unlock_irqrestore(&d->tag_lock, flags);
+		if (skb == NULL)
+			return TAG_INFLIGHT;
+		skb_queue_tail(&skb_outq, skb);
+		wake_up(&ktwaitq);
+		return TAG_REPLAYED;
+	}
+
+	t = kmem_cache_alloc(tag_pool, GFP_ATOMIC);
+	if (t) {
+		t->started = jiffies;
+		t->tag = tag;
+		memcpy(t->addr, addr, ETH_ALEN);
+		hlist_add_head(&t->node, tag_bucket(d, addr, tag));
+	}
+	/* untracked on allocation failure, which only costs us dedup */
+	spin_unlock_irqrestore(&d->tag_lock, flags);
+	return TAG_NEW;
+}
+
+static void tag_cancel(struct aoedev *d, unsigned char *addr, __be32 tag)
+{
+	struct aoetag *t;
+	ulong flags;
+
+	spin_lock_irqsave(&d->tag_lock, flags);
+	t = tag_find(d, addr, tag);
+	if (t)
+		hlist_del(&t->node);
+	spin_unlock_irqrestore(&d->tag_lock, flags);
+
+	if (t)
+		kmem_cache_free(tag_pool, t);
+}
+
+/*
+ * Drop the reply to a request we can't take on right now.  The initiator
+ * retransmits it on its timeout, and the tag is forgotten so that the
+ * retransmit is served.  Answering instead would cost a frame just when
+ * we are short, and initiators only log error replies, they don't back
+ * off for them.
+ */
+static void busy(struct aoedev *d, struct sk_buff *rskb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(rskb);
+
+	tag_cancel(d, aoe->dst, aoe->tag);
+	stat_inc(STAT_BUSY);
+	dev_kfree_skb(rskb);
+}
+
+/* called with the finished reply just before it is queued for transmit */
+static void tag_end(struct aoedev *d, struct sk_buff *rskb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(rskb);
+	struct aoerecent *r;
+	struct sk_buff *old, *clone;
+	struct aoetag *t;
+	ulong flags;
+
+	clone = skb_clone(rskb, GFP_ATOMIC);
+
+	spin_lock_irqsave(&d->tag_lock, flags);
+	t = tag_find(d, aoe->dst, aoe->tag);
+	if (t)
+		hlist_del(&t->node);
+	r = &d->recent[d->nextrecent];
+	d->nextrecent = (d->nextrecent + 1) % nelem(d->recent);
+	old = r->skb;
+	r->skb = clone;
+	r->tag = aoe->tag;
+	memcpy(r->addr, aoe->dst, ETH_ALEN);
+	spin_unlock_irqrestore(&d->tag_lock, flags);
+
+	if (t)
+		kmem_cache_free(tag_pool, t);
+	if (old)
+		dev_kfree_skb_any(old);
+}
+
+static void tag_purge(struct aoedev *d)
+{
+	struct hlist_node *n;
+	struct aoetag *t;
+	int i;
+
+	for (i = 0; i < nelem(d->tags); i++)
+		hlist_for_each_entry_safe(t, n, &d->tags[i], node) {
+			hlist_del(&t->node);
+			kmem_cache_free(tag_pool, t);
+		}
+	for (i = 0; i < nelem(d->recent); i++)
+		if (d->recent[i].skb) {
+			dev_kfree_skb(d->recent[i].skb);
+			d->recent[i].skb = NULL;
+		}
+}
+
+/** 
+ * Send the reply to a finished tree command and free its work item.
+ */ 
+static void tree_work_done(struct tree_work *tw, struct sk_buff *rskb)
+{
+    tag_end(tw->d, rskb);
+    atomic_dec(&tw->d->busy);
+
+    kmem_cache_free(tw_pool,tw);
+    reply_xmit(rskb);
+}
 
 /** 
  * Processes the actual work request and manipulates the 
  * backend. 
- * @param w the work structure containing the request 
+ * @param tw the work item containing the request 
  *  
  */ 
-static void do_tree_work(struct work_struct *w)
+static void do_tree_work(struct tree_work *tw)
 {
     struct sk_buff *rskb;
-    struct tree_work *tw = container_of(w, struct tree_work, work);
+    struct aoe_hdr *ah = (struct aoe_hdr *) skb_mac_header(tw->rskb);
 
-    rskb = treecmd(tw->d, tw->rskb);
+    trace_kvblade_tree_start(tw->rskb);
+    /*the completion finishes the work item*/
+    if (tree_async(tw))
+        return;
+    /*treecmd doesn't free the skb on failure, so keep the key around*/
+    rskb = treecmd(tw->d, tw->rskb, tw->rlen);
 
     if (unlikely(!rskb)) {
         printk("do_tree_work: treecmd(d,rskb) failed\n");
+        tag_cancel(tw->d, ah->dst, ah->tag);
+        dev_kfree_skb(tw->rskb);
+        atomic_dec(&tw->d->busy);
         kmem_cache_free(tw_pool, tw);
         return; /*err*/
     }
+    tree_work_done(tw, rskb);
+}
 
-    atomic_dec(&tw->d->busy);
+static struct treeq treeqs[NTREEQ];
 
-    kmem_cache_free(tw_pool,tw);
-    skb_queue_tail(&skb_outq, rskb);
-    wake_up(&ktwaitq);
+/** 
+ * Run everything on a treeq, oldest first.
+ * @note items queued while this runs are picked up by the same pass
+ *       or, if it already saw the list empty, by the requeued work.
+ */ 
+static void treeq_work(struct work_struct *w)
+{
+    struct treeq *q = container_of(w, struct treeq, work);
+    struct tree_work *tw;
+
+    for (;;) {
+        spin_lock_bh(&q->lock);
+        tw = list_first_entry_or_null(&q->list, struct tree_work, list);
+        if (tw)
+            list_del(&tw->list);
+        spin_unlock_bh(&q->lock);
+        if (!tw)
+            break;
+        do_tree_work(tw);
+    }
 }
 
 /** 
- * Initialise the work structure before first use.
- * @param data a reference to the work struct to initialise 
- * @note as all tree_work items go to the same queue, 
- *       initialising a tree_work struct just once suffices.
- * @note subsequent calls re-using the work structure should 
- *       call PREPARE_WORK()
+ * The queue a tree command belongs on, by the (tid, nid) it touches.
+ * @note CREATE carries no tid, any queue will do for it.
  */ 
-static void tree_work_init_once(void *data)
+static struct treeq *treeq_of(struct tree_work *tw)
+{
+    struct sk_buff *skb = tw->rskb;
+    struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+    struct aoe_datahdr *dh = (struct aoe_datahdr *) aoe->data;
+    struct aoe_treeh *th = (struct aoe_treeh *) aoe->data;
+    struct aoe_treeop *op = (struct aoe_treeop *) th->data;
+    u64 key[2] = { 0, 0 };
+
+    if (aoe->cmd != AOECMD_TREE) {
+        key[0] = dh->tree.tid;
+        key[1] = dh->tree.nid;
+    } else if (tw->rlen >= sizeof *aoe + sizeof *th + sizeof *op) {
+        key[0] = be64_to_cpu(op->tid);
+        key[1] = be64_to_cpu(op->nid);
+    }
+    return &treeqs[jhash2((u32 *) key, 4, 0) & (NTREEQ-1)];
+}
+
+static void treeq_queue(struct tree_work *tw)
+{
+    struct treeq *q = treeq_of(tw);
+
+    spin_lock_bh(&q->lock);
+    list_add_tail(&tw->list, &q->list);
+    spin_unlock_bh(&q->lock);
+    /*a CPU gone offline leaves its queues to the unbound pool*/
+    queue_work_on(cpu_online(q->cpu) ? q->cpu : WORK_CPU_UNBOUND,
+        tree_wq, &q->work);
+}
+
+static void treeq_init(void)
 {
-	struct tree_work *w = data;
-	INIT_WORK(&w->work, do_tree_work);
+    int i, cpu = cpumask_first(cpu_online_mask);
+
+    for (i = 0; i < NTREEQ; i++) {
+        spin_lock_init(&treeqs[i].lock);
+        INIT_LIST_HEAD(&treeqs[i].list);
+        INIT_WORK(&treeqs[i].work, treeq_work);
+        treeqs[i].cpu = cpu;
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_online_mask);
+    }
 }
 
 static struct kobj_type kvblade_ktype;
@@ -271,22 +890,23 @@ static char* spncpy(char *d, const char *s, int n)
 }
 
 
-static void kvblade_announce(struct aoedev *d)
+/* a broadcast CFG response describing d, to go out on nd */
+static struct sk_buff *cfg_build(struct aoedev *d, struct net_device *nd)
 {
 	struct sk_buff *skb;
 	struct aoe_hdr *aoe;
 	struct aoe_cfghdr *cfg;
 	int len = sizeof *aoe + sizeof *cfg + d->nconfig;
 
-	skb = skb_new(d->netdev, len);
+	skb = skb_new(nd, len);
 	if (skb == NULL)
-		return;
+		return NULL;
 
 	aoe = (struct aoe_hdr *) skb_mac_header(skb);
 	cfg = (struct aoe_cfghdr *) aoe->data;
 
 	memset(aoe, 0, sizeof *aoe);
-	memcpy(aoe->src, d->netdev->dev_addr, ETH_ALEN);
+	memcpy(aoe->src, nd->dev_addr, ETH_ALEN);
 	memset(aoe->dst, 0xFF, ETH_ALEN);
 
 	aoe->type = __constant_htons(ETH_P_AOE);
@@ -296,590 +916,3230 @@ static void kvblade_announce(struct aoedev *d)
 	aoe->cmd = AOECMD_CFG;
 
 	memset(cfg, 0, sizeof *cfg);
-	cfg->bufcnt = cpu_to_be16(nelem(d->reqs));
+	cfg->bufcnt = cpu_to_be16(d->bufcnt);
 	cfg->fwver = __constant_htons(0x0002);
-	cfg->scnt = MAXSECTORS(d->netdev->mtu);
+	cfg->scnt = MAXSECTORS(nd->mtu);
 	cfg->aoeccmd = AOE_HVER;
 
 	if (d->nconfig) {
 		cfg->cslen = cpu_to_be16(d->nconfig);
 		memcpy(cfg->data, d->config, d->nconfig);
 	}
-	skb_queue_tail(&skb_outq, skb);
+	return skb;
+}
+
+static void kvblade_announce(struct aoedev *d)
+{
+	struct sk_buff *skb;
+	int i;
+
+	for (i = 0; i < d->npaths; i++) {
+		skb = cfg_build(d, d->paths[i].nd);
+		if (skb)
+			skb_queue_tail(&skb_outq, skb);
+	}
 	wake_up(&ktwaitq);
 }
 
+/* called under lock */
+static struct aoepath *kvblade_path(struct aoedev *d, struct net_device *nd)
+{
+	int i;
 
-static ssize_t kvblade_add(u32 major, u32 minor, char *ifname, char *path)
+	for (i = 0; i < d->npaths; i++)
+		if (d->paths[i].nd == nd)
+			return &d->paths[i];
+	return NULL;
+}
+
+/* 
+ * Each target keeps a built CFG response for answering broadcast queries.
+ * Anything that changes what it says must call this.  Called under lock.
+ */
+static void cfg_invalidate(struct aoedev *d)
 {
-	struct net_device *nd;
-	struct block_device *bd;
-	struct aoedev *d, *td;
-	int ret = 0;
+	int i;
 
-	printk("kvblade_add\n");
-	nd = dev_get_by_name(&init_net, ifname);
-	if (nd == NULL) {
-		eprintk("add failed: interface %s not found.\n", ifname);
-		return -ENOENT;
-	}
-	dev_put(nd);
+	for (i = 0; i < d->npaths; i++)
+		if (d->paths[i].cfgskb) {
+			dev_kfree_skb(d->paths[i].cfgskb);
+			d->paths[i].cfgskb = NULL;
+		}
+}
 
-	bd = blkdev_get_by_path(path, FMODE_READ|FMODE_WRITE, NULL);
-	if (!bd || IS_ERR(bd)) {
-		printk(KERN_ERR "add failed: can't open block device %s: %ld\n", path, PTR_ERR(bd));
-		return -ENOENT;
-	}
+/* called under lock */
+static struct sk_buff *cfg_cached(struct aoedev *d, struct aoepath *p, struct aoe_hdr *q)
+{
+	struct sk_buff *rskb;
+	struct aoe_hdr *aoe;
 
-	if (get_capacity(bd->bd_disk) == 0) {
-		printk(KERN_ERR "add failed: zero sized block device.\n");
-		ret = -ENOENT;
-		goto err;
+	if (p->cfgskb && p->cfgmtu != p->nd->mtu) {
+		dev_kfree_skb(p->cfgskb);
+		p->cfgskb = NULL;
 	}
+	if (p->cfgskb == NULL) {
+		p->cfgskb = cfg_build(d, p->nd);
+		if (p->cfgskb == NULL)
+			return NULL;
+		p->cfgmtu = p->nd->mtu;
+	}
+	rskb = skb_copy(p->cfgskb, GFP_ATOMIC);
+	if (rskb) {
+		aoe = (struct aoe_hdr *) skb_mac_header(rskb);
+		memcpy(aoe->dst, q->src, ETH_ALEN);
+		aoe->tag = q->tag;
+	}
+	return rskb;
+}
 
-	spin_lock(&lock);
-	
-	for (td = devlist; td; td = td->next)
-		if (td->major == major &&
-			td->minor == minor &&
-			td->netdev == nd) {
 
-			spin_unlock(&lock);
+/*
+ * Once a second each target re-derives the buffer count it advertises.
+ * If completions are slower than bufcnt_lat_us the backend is saturated
+ * and initiators are told to back off before we have to drop; if they
+ * are fast and the window is nearly full, it is opened up.  Initiators
+ * learn of a change from an unsolicited CFG response.
+ */
+static void bufcnt_adjust(struct aoedev *d)
+{
+	int n = d->bufcnt;
 
-			printk(KERN_ERR "add failed: device %d.%d already exists on %s.\n",
-				major, minor, ifname);
+	if (atomic_xchg(&d->ncomplete, 0)) {
+		if ((d->lat8 >> 3) > bufcnt_lat_us)
+			n -= n / 4;
+		else if (d->peak >= n - n / 4)
+			n += max(n / 4, 1);
+	}
+	n = clamp(n, (int) BUFCNT_MIN, (int) NREQS);
+	d->peak = atomic_read(&d->busy);
 
-			ret = -EEXIST;
-			goto err;
-		}
-	
-	d = kmalloc(sizeof(struct aoedev), GFP_KERNEL);
-	if (!d) {
-		printk(KERN_ERR "add failed: kmalloc error for %d.%d\n", major, minor);
-		ret = -ENOMEM;
-		goto err;
+	if (n != d->bufcnt) {
+		d->bufcnt = n;
+		cfg_invalidate(d);
+		kvblade_announce(d);
 	}
+}
 
-	memset(d, 0, sizeof(struct aoedev));
-	atomic_set(&d->busy, 0);
-	d->blkdev = bd;
-	d->netdev = nd;
-	d->major = major;
-	d->minor = minor;
-	d->scnt = get_capacity(bd->bd_disk);
-	strncpy(d->path, path, nelem(d->path)-1);
-	spncpy(d->model, "EtherDrive(R) kvblade", nelem(d->model));
-	spncpy(d->sn, "SN HERE", nelem(d->sn));
-	
-	kobject_init_and_add(&d->kobj, &kvblade_ktype, &kvblade_kobj, "%d.%d@%s", major, minor, ifname);
+static void bufcnt_work(struct work_struct *w);
+static DECLARE_DELAYED_WORK(bufcnt_dwork, bufcnt_work);
 
-	d->next = devlist;
-	devlist = d;
-	spin_unlock(&lock);
+static void bufcnt_work(struct work_struct *w)
+{
+	struct aoedev *d;
 
-	dprintk("added %s as %d.%d@%s: %Lu sectors.\n",
-		path, major, minor, ifname, d->scnt);
-	kvblade_announce(d);
-	return 0;
-err:
-	blkdev_put(bd, FMODE_READ|FMODE_WRITE);
-	return ret;
+	spin_lock(&lock);
+	for (d = devlist; d; d = d->next)
+		bufcnt_adjust(d);
+	spin_unlock(&lock);
+	schedule_delayed_work(&bufcnt_dwork, HZ);
 }
 
-static ssize_t kvblade_del(u32 major, u32 minor, char *ifname)
+static ssize_t show_bufcnt(struct aoedev *dev, char *page)
 {
-	struct aoedev *d, **b;
-	int ret;
+	return sprintf(page, "%d\n", dev->bufcnt);
+}
 
-	b = &devlist;
-	d = devlist;
-	spin_lock(&lock);
-	
-	for (; d; b = &d->next, d = *b)
-		if (d->major == major &&
-			d->minor == minor &&
-			strcmp(d->netdev->name, ifname) == 0)
-			break;
+static struct kvblade_sysfs_entry kvblade_sysfs_bufcnt = __ATTR(bufcnt, 0444, show_bufcnt, NULL);
 
-	if (d == NULL) {
-		printk(KERN_ERR "del failed: device %d.%d@%s not found.\n", 
-			major, minor, ifname);
-		ret = -ENOENT;
-		goto err;
-	} else if (atomic_read(&d->busy)) {
-		printk(KERN_ERR "del failed: device %d.%d@%s is busy.\n",
-			major, minor, ifname);
-		ret = -EBUSY;
-		goto err;
-	}
+/*
+ * Announce targets a few at a time, so bringing up a shelf of them
+ * doesn't flood the wire with CFG broadcasts.
+ */
+static void announce_work(struct work_struct *w);
+static DECLARE_DELAYED_WORK(announce_dwork, announce_work);
 
-	*b = d->next;
-	
-	spin_unlock(&lock);
-	
-	blkdev_put(d->blkdev, FMODE_READ|FMODE_WRITE);
-	
-	kobject_del(&d->kobj);
-	kobject_put(&d->kobj);
-	
-	return 0;
-err:
+static void announce_work(struct work_struct *w)
+{
+	struct aoedev *d;
+	int n = 0;
+
+	spin_lock(&lock);
+	for (d = devlist; d && n < ANNOUNCE_BURST; d = d->next)
+		if (d->announce) {
+			d->announce = 0;
+			kvblade_announce(d);
+			n++;
+		}
 	spin_unlock(&lock);
-	return ret;
+	if (n == ANNOUNCE_BURST)
+		schedule_delayed_work(&announce_dwork, 1);
 }
 
-
-static ssize_t store_add(struct aoedev *dev, const char *page, size_t len)
+/*
+ * RAM targets.  A path of "ram:<size>" gives a sparse in-memory disk of
+ * that size in place of a block device, served straight from ata().
+ * Pages are allocated on first write and read as zeros until then.
+ * The kthread and copy_work both get at them, under ram_lock.  They are
+ * freed once the target has drained.
+ */
+static int ram_copy(struct aoedev *d, int rw, sector_t lba, u8 *buf, ulong n)
 {
-	int error = 0;
-	char *argv[16];
-	char *p;
-
-	p = kmalloc(len+1, GFP_KERNEL);
-	memcpy(p, page, len);
-	p[len] = '\0';
-	
-	if (kvblade_sysfs_args(p, argv, nelem(argv)) != 4) {
-		printk(KERN_ERR "bad arg count for add\n");
-		error = -EINVAL;
-	} else
-		error = kvblade_add(simple_strtoul(argv[0], NULL, 0),
-			simple_strtoul(argv[1], NULL, 0),
-			argv[2], argv[3]);
-
-	kfree(p);
-	return error ? error : len;
+	struct page *page;
+	pgoff_t idx;
+	ulong off, cnt;
+	u8 *p;
+	int err = 0;
+
+	spin_lock(&d->ram_lock);
+	while (n) {
+		idx = lba >> (PAGE_SHIFT - 9);
+		off = (lba & ((PAGE_SIZE >> 9) - 1)) << 9;
+		cnt = min_t(ulong, n, PAGE_SIZE - off);
+
+		page = radix_tree_lookup(&d->ram, idx);
+		/* a hole already reads as the zeros it would be given */
+		if (page == NULL && rw == WRITE && memchr_inv(buf, 0, cnt)) {
+			page = alloc_page(GFP_ATOMIC | __GFP_ZERO);
+			if (page == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+			page->index = idx;
+			if (radix_tree_insert(&d->ram, idx, page)) {
+				__free_page(page);
+				err = -ENOMEM;
+				break;
+			}
+			d->rampages++;
+		}
+		if (page) {
+			p = kmap_atomic(page);
+			if (rw == WRITE)
+				memcpy(p + off, buf, cnt);
+			else
+				memcpy(buf, p + off, cnt);
+			kunmap_atomic(p);
+		} else if (rw == READ)
+			memset(buf, 0, cnt);
+
+		buf += cnt;
+		lba += cnt >> 9;
+		n -= cnt;
+	}
+	spin_unlock(&d->ram_lock);
+	return err;
 }
 
+/* drop the pages wholly inside a trimmed range */
+static void ram_discard(struct aoedev *d, sector_t lba, ulong cnt)
+{
+	pgoff_t idx, end;
+	struct page *page;
 
-static struct kvblade_sysfs_entry kvblade_sysfs_add = __ATTR(add, 0644, NULL, store_add);
+	idx = DIV_ROUND_UP(lba, PAGE_SIZE >> 9);
+	end = (lba + cnt) >> (PAGE_SHIFT - 9);
+	spin_lock(&d->ram_lock);
+	for (; idx < end; idx++) {
+		page = radix_tree_delete(&d->ram, idx);
+		if (page) {
+			__free_page(page);
+			d->rampages--;
+		}
+	}
+	spin_unlock(&d->ram_lock);
+}
 
-static ssize_t store_del(struct aoedev *dev, const char *page, size_t len)
+/*
+ * The allocation bitmap, on when a target's sparse attribute says so.
+ * A bit stands for 1 << SPARSE_SHIFT sectors and is set once they may
+ * hold anything but zeros; bits are never cleared, so a racing write can
+ * only make a read go to the backend needlessly.  Reads of clear bits
+ * are answered with zeros, and zero writes to them need no I/O at all.
+ * Writes mark the bitmap from the moment it is installed, but it is only
+ * believed once alloc_ready is set, after the holes of a file backend
+ * have been found.  Both are used under lock.
+ */
+static int sparse_any(struct aoedev *d, sector_t lba, ulong cnt)
 {
-	int error = 0;
-	char *argv[16];
-	char *p;
-
-	p = kmalloc(len+1, GFP_KERNEL);
-	memcpy(p, page, len);
-	p[len] = '\0';
+	ulong i, end;
+
+	if (cnt == 0)
+		return 0;
+	end = (lba + cnt - 1) >> SPARSE_SHIFT;
+	for (i = lba >> SPARSE_SHIFT; i <= end; i++)
+		if (test_bit(i, d->alloc))
+			return 1;
+	return 0;
+}
 
-	if (kvblade_sysfs_args(p, argv, nelem(argv)) != 3) {
-		printk(KERN_ERR "bad arg count for del\n");
-		error = -EINVAL;
-	} else
-		error = kvblade_del(simple_strtoul(argv[0], NULL, 0),
-			simple_strtoul(argv[1], NULL, 0),
-			argv[2]);
+static void sparse_mark(unsigned long *map, sector_t lba, ulong cnt)
+{
+	ulong i, end;
 
-	kfree(p);
-	return error ? error : len;
+	if (cnt == 0)
+		return;
+	end = (lba + cnt - 1) >> SPARSE_SHIFT;
+	for (i = lba >> SPARSE_SHIFT; i <= end; i++)
+		set_bit(i, map);
 }
 
-static struct kvblade_sysfs_entry kvblade_sysfs_del = __ATTR(del, 0644, NULL, store_del);
-
-static ssize_t show_scnt(struct aoedev *dev, char *page)
+static ulong sparse_bits(struct aoedev *d)
 {
-	return sprintf(page, "%Ld\n", dev->scnt);
+	return (d->scnt + (1 << SPARSE_SHIFT) - 1) >> SPARSE_SHIFT;
 }
 
-static struct kvblade_sysfs_entry kvblade_sysfs_scnt = __ATTR(scst, 0644, show_scnt, NULL);
-
-static ssize_t show_bdev(struct aoedev *dev, char *page)
+/* mark what a file backend holds data for; all of it if it can't say */
+static void sparse_scan(struct aoedev *d, unsigned long *map)
 {
-	return print_dev_t(page, dev->blkdev->bd_dev);
-}
+	loff_t pos = 0, end, size = d->scnt << 9;
 
-static struct kvblade_sysfs_entry kvblade_sysfs_bdev = __ATTR(bdev, 0644, show_bdev, NULL);
+	while (pos < size) {
+		pos = vfs_llseek(d->filp, pos, SEEK_DATA);
+		if (pos == -ENXIO)
+			break;
+		if (pos < 0) {
+			sparse_mark(map, 0, d->scnt);
+			break;
+		}
+		if (pos >= size)
+			break;
+		end = vfs_llseek(d->filp, pos, SEEK_HOLE);
+		if (end < 0 || end > size)
+			end = size;
+		sparse_mark(map, pos >> 9, ((end + 511) >> 9) - (pos >> 9));
+		pos = end;
+	}
+}
 
-static ssize_t show_bpath(struct aoedev *dev, char *page)
+static void ram_free(struct aoedev *d)
 {
-	return sprintf(page, "%.*s\n", (int) nelem(dev->path), dev->path);
-}
+	struct page *pages[16];
+	pgoff_t idx = 0;
+	int i, n;
 
-static struct kvblade_sysfs_entry kvblade_sysfs_bpath = __ATTR(bpath, 0644, show_bpath, NULL);
+	do {
+		n = radix_tree_gang_lookup(&d->ram, (void **) pages, idx, nelem(pages));
+		for (i = 0; i < n; i++) {
+			idx = pages[i]->index;
+			radix_tree_delete(&d->ram, idx);
+			__free_page(pages[i]);
+		}
+		idx++;
+	} while (n == nelem(pages));
+	d->rampages = 0;
+}
 
-static ssize_t show_model(struct aoedev *dev, char *page)
+/* give back what kvblade_open got the target's sectors from */
+static void kvblade_put_backend(struct aoedev *d)
 {
-	return sprintf(page, "%.*s\n", (int) nelem(dev->model), dev->model);
+	unsigned long *map;
+
+	spin_lock(&lock);
+	map = d->alloc;
+	d->alloc = NULL;
+	d->alloc_ready = 0;
+	spin_unlock(&lock);
+	vfree(map);
+	switch (d->backend) {
+	case BE_BDEV:
+		blkdev_put(d->blkdev, FMODE_READ|FMODE_WRITE);
+		break;
+	case BE_RAM:
+		ram_free(d);
+		break;
+	case BE_FILE:
+		filp_close(d->filp, NULL);
+		break;
+	}
 }
 
-static ssize_t store_model(struct aoedev *dev, const char *page, size_t len)
+static void file_work(struct work_struct *w);
+static void copy_cancel(struct aoedev *d);
+
+/*
+ * Targets are added and removed in three steps: kvblade_open() does
+ * everything that can fail without touching devlist, the caller links
+ * the result in under lock, and kvblade_publish() registers it in sysfs
+ * and schedules the announcement.  That lets a batch fail as a whole.
+ * All of it runs under ctl_mutex.  A target's own attributes only try
+ * for it and restart otherwise: removing the target holds it while
+ * kobject_del waits for those attributes to return.
+ */
+static DEFINE_MUTEX(ctl_mutex);
+
+/*
+ * Regular files are served directly rather than through a loop device.
+ * If path is one, *filp is left open on it.
+ */
+static int kvblade_regular(char *path, struct file **filp)
 {
-	spncpy(dev->model, page, nelem(dev->model));
-	return 0;
+	struct file *f;
+
+	f = filp_open(path, O_RDWR|O_LARGEFILE, 0);
+	if (IS_ERR(f))
+		return 0;
+	if (!S_ISREG(file_inode(f)->i_mode)) {
+		filp_close(f, NULL);
+		return 0;
+	}
+	*filp = f;
+	return 1;
 }
 
-static struct kvblade_sysfs_entry kvblade_sysfs_model = __ATTR(model, 0644, show_model, store_model);
-
-static ssize_t show_sn(struct aoedev *dev, char *page)
+static struct aoedev *kvblade_open(u32 major, u32 minor, char *ifname, char *path)
 {
-	return sprintf(page, "%.*s\n", (int) nelem(dev->sn), dev->sn);
+	struct net_device *nd;
+	struct block_device *bd = NULL;
+	struct file *filp = NULL;
+	struct aoedev *d;
+	loff_t scnt;
+	char *end;
+	int i, ret;
+
+	nd = dev_get_by_name(&init_net, ifname);
+	if (nd == NULL) {
+		eprintk("add failed: interface %s not found.\n", ifname);
+		return ERR_PTR(-ENOENT);
+	}
+	dev_put(nd);
+
+	if (strncmp(path, "ram:", 4) == 0) {
+		scnt = memparse(path + 4, &end) >> 9;
+		if (*end || scnt == 0) {
+			printk(KERN_ERR "add failed: bad ram size %s\n", path + 4);
+			return ERR_PTR(-EINVAL);
+		}
+	} else if (kvblade_regular(path, &filp)) {
+		scnt = i_size_read(file_inode(filp)) >> 9;
+		if (scnt == 0) {
+			printk(KERN_ERR "add failed: file %s is under a sector.\n", path);
+			ret = -ENOENT;
+			goto err;
+		}
+	} else {
+		bd = blkdev_get_by_path(path, FMODE_READ|FMODE_WRITE, NULL);
+		if (!bd || IS_ERR(bd)) {
+			printk(KERN_ERR "add failed: can't open block device %s: %ld\n", path, PTR_ERR(bd));
+			return ERR_PTR(-ENOENT);
+		}
+
+		scnt = get_capacity(bd->bd_disk);
+		if (scnt == 0) {
+			printk(KERN_ERR "add failed: zero sized block device.\n");
+			ret = -ENOENT;
+			goto err;
+		}
+	}
+
+	d = kzalloc(sizeof(struct aoedev), GFP_KERNEL);
+	if (!d) {
+		printk(KERN_ERR "add failed: kmalloc error for %d.%d\n", major, minor);
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	atomic_set(&d->busy, 0);
+	spin_lock_init(&d->tag_lock);
+	d->bufcnt = BUFCNT_INIT;
+	d->tree_k = TREE_KDEFAULT;
+	d->iops.stamp = d->bw.stamp = jiffies;
+	d->announce = 1;
+	d->backend = bd ? BE_BDEV : filp ? BE_FILE : BE_RAM;
+	d->blkdev = bd;
+	INIT_RADIX_TREE(&d->ram, GFP_ATOMIC);
+	spin_lock_init(&d->ram_lock);
+	d->filp = filp;
+	for (i = 0; i < nelem(d->reqs); i++)
+		INIT_WORK(&d->reqs[i].work, file_work);
+	d->netdev = nd;
+	d->paths[0].nd = nd;
+	d->npaths = 1;
+	d->major = major;
+	d->minor = minor;
+	d->scnt = scnt;
+	strncpy(d->path, path, nelem(d->path)-1);
+	spncpy(d->model, "EtherDrive(R) kvblade", nelem(d->model));
+	spncpy(d->sn, "SN HERE", nelem(d->sn));
+	return d;
+err:
+	if (bd)
+		blkdev_put(bd, FMODE_READ|FMODE_WRITE);
+	if (filp)
+		filp_close(filp, NULL);
+	return ERR_PTR(ret);
 }
 
-static ssize_t store_sn(struct aoedev *dev, const char *page, size_t len)
+/* undo kvblade_open for a target that never made it onto devlist */
+static void kvblade_close(struct aoedev *d)
 {
-	spncpy(dev->sn, page, nelem(dev->sn));
-	return 0; 
+	kvblade_put_backend(d);
+	kfree(d);
 }
 
-static struct kvblade_sysfs_entry kvblade_sysfs_sn = __ATTR(sn, 0644, show_sn, store_sn);
+static void kvblade_publish(struct aoedev *d)
+{
+	kobject_init_and_add(&d->kobj, &kvblade_ktype, &kvblade_kobj,
+		"%d.%d@%s", d->major, d->minor, d->netdev->name);
+	dprintk("added %s as %d.%d@%s: %Lu sectors.\n",
+		d->path, d->major, d->minor, d->netdev->name, d->scnt);
+	schedule_delayed_work(&announce_dwork, 0);
+}
 
-static struct attribute *kvblade_ktype_attrs[] = {
-	&kvblade_sysfs_scnt.attr,
-	&kvblade_sysfs_bdev.attr,
-	&kvblade_sysfs_bpath.attr,
-	&kvblade_sysfs_model.attr,
-	&kvblade_sysfs_sn.attr,
-	NULL,
-};
+/* called under lock; any of a target's interfaces will find it */
+static struct aoedev *kvblade_find(u32 major, u32 minor, struct net_device *nd, char *ifname)
+{
+	struct aoedev *d;
+	int i;
 
-static struct attribute *kvblade_ktype_ops_attrs[] = {
-	&kvblade_sysfs_add.attr,
-	&kvblade_sysfs_del.attr,
-	NULL,
-};
+	for (d = devlist; d; d = d->next) {
+		if (d->major != major || d->minor != minor)
+			continue;
+		for (i = 0; i < d->npaths; i++)
+			if (nd ? d->paths[i].nd == nd :
+				strcmp(d->paths[i].nd->name, ifname) == 0)
+				return d;
+	}
+	return NULL;
+}
 
-static ssize_t kvblade_attr_show(struct kobject *kobj, struct attribute *attr, char *page)
+/* called under lock; no new frames will find d once this returns */
+static void kvblade_unlink(struct aoedev *d)
 {
-	struct kvblade_sysfs_entry *entry;
-	struct aoedev *dev;
+	struct aoedev **b;
 
-	entry = container_of(attr, struct kvblade_sysfs_entry, attr);
-	dev = container_of(kobj, struct aoedev, kobj);
-
-	if (!entry->show)
-		return -EIO;
+	for (b = &devlist; *b; b = &(*b)->next)
+		if (*b == d) {
+			*b = d->next;
+			break;
+		}
+}
 
-	return entry->show(dev, page);
+/* wait for what d still has in flight, then let it go */
+static void kvblade_drain(struct aoedev *d)
+{
+	copy_cancel(d);
+	while (atomic_read(&d->busy))
+		msleep(100);
+	kvblade_put_backend(d);
+	tag_purge(d);
+	cfg_invalidate(d);
+	
+	kobject_del(&d->kobj);
+	kobject_put(&d->kobj);
 }
 
-static ssize_t kvblade_attr_store(struct kobject *kobj, struct attribute *attr,
-			const char *page, size_t length)
+static ssize_t kvblade_add(u32 major, u32 minor, char *ifname, char *path)
 {
-	ssize_t ret;
-	struct kvblade_sysfs_entry *entry;
+	struct aoedev *d;
 
-	entry = container_of(attr, struct kvblade_sysfs_entry, attr);
+	printk("kvblade_add\n");
+	d = kvblade_open(major, minor, ifname, path);
+	if (IS_ERR(d))
+		return PTR_ERR(d);
 
-	if (kobj == &kvblade_kobj)
-		ret = entry->store(NULL, page, length);
-	else {
-		struct aoedev *dev = container_of(kobj, struct aoedev, kobj);
+	spin_lock(&lock);
+	if (kvblade_find(major, minor, d->netdev, NULL)) {
+		spin_unlock(&lock);
+		printk(KERN_ERR "add failed: device %d.%d already exists on %s.\n",
+			major, minor, ifname);
+		kvblade_close(d);
+		return -EEXIST;
+	}
+	d->next = devlist;
+	devlist = d;
+	spin_unlock(&lock);
 
-		if (!entry->store)
-			return -EIO;
+	kvblade_publish(d);
+	return 0;
+}
 
-		ret = entry->store(dev, page, length);
+static ssize_t kvblade_del(u32 major, u32 minor, char *ifname)
+{
+	struct aoedev *d;
+
+	spin_lock(&lock);
+	d = kvblade_find(major, minor, NULL, ifname);
+	if (d == NULL) {
+		spin_unlock(&lock);
+		printk(KERN_ERR "del failed: device %d.%d@%s not found.\n", 
+			major, minor, ifname);
+		return -ENOENT;
 	}
+	kvblade_unlink(d);
+	spin_unlock(&lock);
 
-	return ret;
+	kvblade_drain(d);
+	return 0;
 }
 
-static const struct sysfs_ops kvblade_sysfs_ops = {
-	.show		= kvblade_attr_show,
-	.store		= kvblade_attr_store,
+/*
+ * Batches.  Lines of "add major minor ifname path" and "del major minor
+ * ifname" written to /sys/kvblade/batch pile up, as many writes as it
+ * takes, until "commit" applies them all or none of them.  "abort"
+ * throws them away.
+ *
+ * An add may be followed by "attach major minor ifname ifname2" and
+ * "config major minor ifname hex", which give the new target another
+ * interface and its config string, by "model" and "sn" lines with the
+ * identify strings in hex, and by "iops_limit", "bw_limit" and "tree_k"
+ * lines with a number.  That is what a target's state attribute prints,
+ * so saved targets come back in one batch.
+ */
+struct batchop {
+	struct list_head list;
+	int del;
+	u32 major;
+	u32 minor;
+	char ifname[IFNAMSIZ];
+	char path[256];
+	struct aoedev *d;	/* opened for an add, found for a del */
+	char attach[NPATHS-1][IFNAMSIZ];
+	int nattach;
+	unsigned char config[1024];
+	int nconfig;
+	char model[ATA_MODEL_LEN];
+	char sn[ATA_ID_SERNO_LEN];
+	int hasmodel, hassn;
+	u64 iops, bw;
+	int tree_k;		/* 0 leaves the default */
 };
 
-static struct kobj_type kvblade_ktype = {
-	.default_attrs	= kvblade_ktype_attrs,
-	.sysfs_ops		= &kvblade_sysfs_ops,
-	.release		= kvblade_release,
-};
+static LIST_HEAD(batch);
 
-static struct kobj_type kvblade_ktype_ops = {
-	.default_attrs	= kvblade_ktype_ops_attrs,
-	.sysfs_ops		= &kvblade_sysfs_ops,
-	.release		= kvblade_release,
-};
+static void batch_abort(void)
+{
+	struct batchop *op, *n;
 
+	list_for_each_entry_safe(op, n, &batch, list) {
+		list_del(&op->list);
+		if (op->d && !op->del)
+			kvblade_close(op->d);
+		kfree(op);
+	}
+}
 
-static void setfld(u16 *a, int idx, int len, char *str)
+static int batch_deleting(struct aoedev *d, struct batchop *upto)
 {
-	u8 *p;
+	struct batchop *op;
 
-	for (p = (u8*)(a + idx); len; p += 2, len -= 2) {
-		p[1] = *str ? *str++ : ' ';
-		p[0] = *str ? *str++ : ' ';
+	list_for_each_entry(op, &batch, list) {
+		if (op == upto)
+			break;
+		if (op->del && op->d == d)
+			return 1;
 	}
+	return 0;
 }
 
-static int ata_identify(struct aoedev *d, struct aoe_datahdr *dh)
+/* called under lock */
+static int batch_check(void)
 {
-	char 	buf[64];
-	u16     *words  = (u16 *)dh->data;
-	u8      *cp;
-	loff_t  scnt;
-
+	struct batchop *op, *o;
+	struct net_device *nd = NULL;
+	struct aoedev *d;
+	int i;
 
-	memset(words, 0, 512);
+	list_for_each_entry(op, &batch, list) {
+		if (!op->del)
+			continue;
+		op->d = kvblade_find(op->major, op->minor, NULL, op->ifname);
+		if (op->d == NULL || batch_deleting(op->d, op)) {
+			printk(KERN_ERR "batch failed: device %d.%d@%s not found.\n",
+				op->major, op->minor, op->ifname);
+			return -ENOENT;
+		}
+	}
+	list_for_each_entry(op, &batch, list) {
+		if (op->del)
+			continue;
+		for (i = 0; i < op->d->npaths; i++) {
+			nd = op->d->paths[i].nd;
+			d = kvblade_find(op->major, op->minor, nd, NULL);
+			if (d && !batch_deleting(d, NULL))
+				goto exists;
+			list_for_each_entry(o, &batch, list) {
+				if (o == op)
+					break;
+				if (!o->del && o->major == op->major &&
+					o->minor == op->minor && kvblade_path(o->d, nd))
+					goto exists;
+			}
+		}
+	}
+	return 0;
+exists:
+	printk(KERN_ERR "batch failed: device %d.%d already exists on %s.\n",
+		op->major, op->minor, nd->name);
+	return -EEXIST;
+}
 
-	words[47] = 0x8000;
-	words[49] = 0x0200;
-	words[50] = 0x4000;
-	words[83] = 0x5400;
-	words[84] = 0x4000;
-	words[86] = 0x1400;
-	words[87] = 0x4000;
-	words[93] = 0x400b;
+/* give a target opened for an add the interfaces and config it came with */
+static int batch_setup(struct batchop *op)
+{
+	struct aoedev *d = op->d;
+	struct net_device *nd;
+	int i;
 
-	sprintf(buf, "V%d.%d\n", 0, 2);
-	setfld(words, 23,  8, buf);
-	setfld(words, 27, nelem(d->model), d->model);
-	setfld(words, 10, nelem(d->sn), d->sn);
+	for (i = 0; i < op->nattach; i++) {
+		nd = dev_get_by_name(&init_net, op->attach[i]);
+		if (nd == NULL) {
+			eprintk("batch failed: interface %s not found.\n", op->attach[i]);
+			return -ENOENT;
+		}
+		dev_put(nd);
+		if (kvblade_path(d, nd)) {
+			eprintk("batch failed: %d.%d is on %s twice.\n",
+				op->major, op->minor, nd->name);
+			return -EEXIST;
+		}
+		d->paths[d->npaths++].nd = nd;
+	}
+	memcpy(d->config, op->config, op->nconfig);
+	d->nconfig = op->nconfig;
+	if (op->hasmodel)
+		memcpy(d->model, op->model, sizeof d->model);
+	if (op->hassn)
+		memcpy(d->sn, op->sn, sizeof d->sn);
+	d->iops.rate = op->iops;
+	d->bw.rate = op->bw;
+	if (op->tree_k)
+		d->tree_k = op->tree_k;
+	return 0;
+}
 
-	scnt = d->scnt;
-	cp = (u8 *)&words[100];
-	*cp++ = scnt;
-	*cp++ = (scnt >>= 8);
-	*cp++ = (scnt >>= 8);
-	*cp++ = (scnt >>= 8);
-	*cp++ = (scnt >>= 8);
-	*cp++ = (scnt >>= 8);
+static int batch_commit(void)
+{
+	struct batchop *op, *n;
+	int ret;
 
-	scnt = d->scnt;
-	cp = (u8 *)&words[60];
+	/* everything that can fail happens before devlist changes */
+	list_for_each_entry(op, &batch, list) {
+		if (op->del)
+			continue;
+		op->d = kvblade_open(op->major, op->minor, op->ifname, op->path);
+		if (IS_ERR(op->d)) {
+			ret = PTR_ERR(op->d);
+			op->d = NULL;
+			goto err;
+		}
+		ret = batch_setup(op);
+		if (ret)
+			goto err;
+	}
 
-	if (scnt & ~ATA_LBA28MAX)
-		scnt = ATA_LBA28MAX;
-	*cp++ = scnt;
-	*cp++ = (scnt >>= 8);
-	*cp++ = (scnt >>= 8);
-	*cp++ = (scnt >>= 8) & 0xf;
+	spin_lock(&lock);
+	ret = batch_check();
+	if (ret) {
+		spin_unlock(&lock);
+		goto err;
+	}
+	list_for_each_entry(op, &batch, list)
+		if (op->del)
+			kvblade_unlink(op->d);
+		else {
+			op->d->next = devlist;
+			devlist = op->d;
+		}
+	spin_unlock(&lock);
 
-	return 512;
+	list_for_each_entry_safe(op, n, &batch, list) {
+		if (op->del)
+			kvblade_drain(op->d);
+		else
+			kvblade_publish(op->d);
+		list_del(&op->list);
+		kfree(op);
+	}
+	return 0;
+err:
+	/* deletes only found their targets, they hold nothing */
+	list_for_each_entry(op, &batch, list)
+		if (op->del)
+			op->d = NULL;
+	batch_abort();
+	return ret;
 }
 
-static void ata_io_complete(struct bio *bio, int error)
+/* the add earlier in the batch that "attach" or "config" refers to */
+static struct batchop *batch_added(char *argv[])
 {
-	struct aoereq *rq;
-	struct aoedev *d;
-	struct sk_buff *skb;
-	struct aoe_hdr *aoe;
-    struct aoe_datahdr *dh;
-	int len;
-	unsigned int bytes = 0;
-
-	if (!error)
-		bytes = bio->bi_io_vec[0].bv_len;
+	struct batchop *op;
+	u32 major = simple_strtoul(argv[1], NULL, 0);
+	u32 minor = simple_strtoul(argv[2], NULL, 0);
+
+	list_for_each_entry_reverse(op, &batch, list)
+		if (!op->del && op->major == major && op->minor == minor &&
+			strcmp(op->ifname, argv[3]) == 0)
+			return op;
+	printk(KERN_ERR "bad batch line: %s of %s.%s@%s with no add before it\n",
+		argv[0], argv[1], argv[2], argv[3]);
+	return NULL;
+}
 
-	rq = bio->bi_private;
-	d = rq->d;
-	skb = rq->skb;
+static int batch_attach(char *argv[])
+{
+	struct batchop *op = batch_added(argv);
+
+	if (!op)
+		return -EINVAL;
+	if (op->nattach == nelem(op->attach)) {
+		printk(KERN_ERR "bad batch line: %s.%s@%s is on too many interfaces\n",
+			argv[1], argv[2], argv[3]);
+		return -ENOSPC;
+	}
+	strncpy(op->attach[op->nattach++], argv[4], IFNAMSIZ-1);
+	return 0;
+}
 
-	aoe = (struct aoe_hdr *) skb_mac_header(skb);
-	dh = (struct aoe_datahdr *) aoe->data;
+static int batch_config(char *argv[])
+{
+	struct batchop *op = batch_added(argv);
+	int n = strlen(argv[4]);
+
+	if (!op)
+		return -EINVAL;
+	if (n % 2 || n / 2 > nelem(op->config) || hex2bin(op->config, argv[4], n / 2)) {
+		printk(KERN_ERR "bad batch line: config of %s.%s@%s is not hex\n",
+			argv[1], argv[2], argv[3]);
+		return -EINVAL;
+	}
+	op->nconfig = n / 2;
+	return 0;
+}
 
-	len = sizeof *aoe + sizeof *dh;
-	if (bio_flagged(bio, BIO_UPTODATE)) {
-		if (bio_data_dir(bio) == READ)
-			len += bytes;
-		dh->ata.scnt = 0;
-		dh->ata.cmdstat = ATA_DRDY;
-		dh->ata.errfeat = 0;
-		// should increment lba here, too
+/* model and sn, in hex like config as they are space padded */
+static int batch_ident(char *argv[])
+{
+	struct batchop *op = batch_added(argv);
+	char *id;
+	int n;
+
+	if (!op)
+		return -EINVAL;
+	if (strcmp(argv[0], "model") == 0) {
+		id = op->model;
+		n = nelem(op->model);
+		op->hasmodel = 1;
 	} else {
-		dprintk(KERN_ERR "I/O error %d on %s\n", error, d->kobj.name);
-		dh->ata.cmdstat = ATA_ERR | ATA_DF;
-		dh->ata.errfeat = ATA_UNC | ATA_ABORTED;
+		id = op->sn;
+		n = nelem(op->sn);
+		op->hassn = 1;
+	}
+	if (strlen(argv[4]) != 2 * n || hex2bin((u8 *) id, argv[4], n)) {
+		printk(KERN_ERR "bad batch line: %s of %s.%s@%s is not %d bytes of hex\n",
+			argv[0], argv[1], argv[2], argv[3], n);
+		return -EINVAL;
 	}
+	return 0;
+}
 
-	bio_put(bio);
-	rq->skb = NULL;
-	atomic_dec(&d->busy);
+static int batch_number(char *argv[])
+{
+	struct batchop *op = batch_added(argv);
+	unsigned long long v;
+
+	if (!op)
+		return -EINVAL;
+	if (kstrtoull(argv[4], 0, &v) ||
+		(strcmp(argv[0], "tree_k") == 0 && (v == 0 || v > TREE_KMAX))) {
+		printk(KERN_ERR "bad batch line: %s of %s.%s@%s is %s\n",
+			argv[0], argv[1], argv[2], argv[3], argv[4]);
+		return -EINVAL;
+	}
+	if (strcmp(argv[0], "iops_limit") == 0)
+		op->iops = v;
+	else if (strcmp(argv[0], "bw_limit") == 0)
+		op->bw = v;
+	else
+		op->tree_k = v;
+	return 0;
+}
 
-	skb_trim(skb, len);
-	skb_queue_tail(&skb_outq, skb);
+static int batch_line(char *line)
+{
+	struct batchop *op;
+	char *argv[8];
+	int argc;
+
+	argc = kvblade_sysfs_args(line, argv, nelem(argv));
+	if (argc == 0)
+		return 0;
+	if (argc == 1 && strcmp(argv[0], "commit") == 0)
+		return batch_commit();
+	if (argc == 1 && strcmp(argv[0], "abort") == 0) {
+		batch_abort();
+		return 0;
+	}
 
-	wake_up(&ktwaitq);
+	if (argc == 5 && strcmp(argv[0], "attach") == 0)
+		return batch_attach(argv);
+	if (argc == 5 && strcmp(argv[0], "config") == 0)
+		return batch_config(argv);
+	if (argc == 5 && (strcmp(argv[0], "model") == 0 ||
+		strcmp(argv[0], "sn") == 0))
+		return batch_ident(argv);
+	if (argc == 5 && (strcmp(argv[0], "iops_limit") == 0 ||
+		strcmp(argv[0], "bw_limit") == 0 || strcmp(argv[0], "tree_k") == 0))
+		return batch_number(argv);
+
+	op = kzalloc(sizeof(*op), GFP_KERNEL);
+	if (!op)
+		return -ENOMEM;
+	if (argc == 5 && strcmp(argv[0], "add") == 0)
+		strncpy(op->path, argv[4], nelem(op->path)-1);
+	else if (argc == 4 && strcmp(argv[0], "del") == 0)
+		op->del = 1;
+	else {
+		printk(KERN_ERR "bad batch line: %s\n", argv[0]);
+		kfree(op);
+		return -EINVAL;
+	}
+	op->major = simple_strtoul(argv[1], NULL, 0);
+	op->minor = simple_strtoul(argv[2], NULL, 0);
+	strncpy(op->ifname, argv[3], nelem(op->ifname)-1);
+	list_add_tail(&op->list, &batch);
+	return 0;
 }
 
-static inline loff_t readlba(u8 *lba)
+
+static ssize_t store_add(struct aoedev *dev, const char *page, size_t len)
 {
-	loff_t n = 0ULL;
-	int i;
+	int error = 0;
+	char *argv[16];
+	char *p;
 
-	for (i=5; i>=0; i--) {
-		n <<= 8;
-		n |= lba[i];
+	p = kmalloc(len+1, GFP_KERNEL);
+	memcpy(p, page, len);
+	p[len] = '\0';
+	
+	if (kvblade_sysfs_args(p, argv, nelem(argv)) != 4) {
+		printk(KERN_ERR "bad arg count for add\n");
+		error = -EINVAL;
+	} else {
+		mutex_lock(&ctl_mutex);
+		error = kvblade_add(simple_strtoul(argv[0], NULL, 0),
+			simple_strtoul(argv[1], NULL, 0),
+			argv[2], argv[3]);
+		mutex_unlock(&ctl_mutex);
 	}
-	return n;
+
+	kfree(p);
+	return error ? error : len;
 }
 
-static struct sk_buff * ata(struct aoedev *d, struct sk_buff *skb)
+
+static struct kvblade_sysfs_entry kvblade_sysfs_add = __ATTR(add, 0644, NULL, store_add);
+
+static ssize_t store_del(struct aoedev *dev, const char *page, size_t len)
 {
-	struct aoe_hdr *aoe;
-    struct aoe_datahdr *dh;
-	struct aoereq *rq, *e;
-	struct bio *bio;
-	sector_t lba;
-	int len, rw;
-	struct page *page;
-	ulong bcnt, offset;
+	int error = 0;
+	char *argv[16];
+	char *p;
 
-	aoe = (struct aoe_hdr *) skb_mac_header(skb);
-	dh = (struct aoe_datahdr *) aoe->data;
-	lba = readlba(dh->ata.lba);
-	len = sizeof *aoe + sizeof *dh;
-	switch (dh->ata.cmdstat) {
-	do {
-	case ATA_CMD_PIO_READ:
-		lba &= ATA_LBA28MAX;
-	case ATA_CMD_PIO_READ_EXT:
-		lba &= 0x0000FFFFFFFFFFFFULL;
-		rw = READ;
-		break;
-	case ATA_CMD_PIO_WRITE:
-		lba &= ATA_LBA28MAX;
-	case ATA_CMD_PIO_WRITE_EXT:
-		lba &= 0x0000FFFFFFFFFFFFULL;
-		rw = WRITE;
-	} while (0);
-		if ((lba + dh->ata.scnt) > d->scnt) {
-			printk(KERN_ERR "sector I/O is out of range: %Lu (%d), max %Lu\n",
-				(long long) lba, dh->ata.scnt, d->scnt);
-			dh->ata.cmdstat = ATA_ERR;
-			dh->ata.errfeat = ATA_IDNF;
+	p = kmalloc(len+1, GFP_KERNEL);
+	memcpy(p, page, len);
+	p[len] = '\0';
+
+	if (kvblade_sysfs_args(p, argv, nelem(argv)) != 3) {
+		printk(KERN_ERR "bad arg count for del\n");
+		error = -EINVAL;
+	} else {
+		mutex_lock(&ctl_mutex);
+		error = kvblade_del(simple_strtoul(argv[0], NULL, 0),
+			simple_strtoul(argv[1], NULL, 0),
+			argv[2]);
+		mutex_unlock(&ctl_mutex);
+	}
+
+	kfree(p);
+	return error ? error : len;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_del = __ATTR(del, 0644, NULL, store_del);
+
+static ssize_t store_batch(struct aoedev *dev, const char *page, size_t len)
+{
+	int error = 0;
+	char *p, *line, *s;
+
+	p = kmalloc(len+1, GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+	memcpy(p, page, len);
+	p[len] = '\0';
+
+	mutex_lock(&ctl_mutex);
+	for (s = p; (line = strsep(&s, "\n")) != NULL; ) {
+		error = batch_line(line);
+		if (error) {
+			batch_abort();
 			break;
 		}
-		rq = d->reqs;
-		e = rq + nelem(d->reqs);
-		for (; rq<e; rq++)
-			if (rq->skb == NULL)
-				break;
-		if (rq == e)
-			goto drop;
-		
-		bio = bio_alloc(GFP_ATOMIC, 1);
-		if (bio == NULL) {
-			eprintk("can't alloc bio\n");
-			goto drop;
-		}
-		rq->bio = bio;
-		rq->d = d;
+	}
+	mutex_unlock(&ctl_mutex);
+
+	kfree(p);
+	return error ? error : len;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_batch = __ATTR(batch, 0200, NULL, store_batch);
+
+static ssize_t show_stats(struct aoedev *dev, char *page)
+{
+	ssize_t n = 0;
+	int i;
+
+	for (i = 0; i < NSTATS; i++)
+		n += scnprintf(page + n, PAGE_SIZE - n, "%-10s %llu %llu/s\n",
+			statnames[i], stat_read(i), stat_rate[i]);
+	return n;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_stats = __ATTR(stats, 0444, show_stats, NULL);
+
+static ssize_t show_scnt(struct aoedev *dev, char *page)
+{
+	return sprintf(page, "%Ld\n", dev->scnt);
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_scnt = __ATTR(scst, 0644, show_scnt, NULL);
+
+static ssize_t show_bdev(struct aoedev *dev, char *page)
+{
+	return print_dev_t(page, dev->blkdev ? dev->blkdev->bd_dev : 0);
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_bdev = __ATTR(bdev, 0644, show_bdev, NULL);
+
+static ssize_t show_bpath(struct aoedev *dev, char *page)
+{
+	return sprintf(page, "%.*s\n", (int) nelem(dev->path), dev->path);
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_bpath = __ATTR(bpath, 0644, show_bpath, NULL);
+
+/* bytes of RAM a ram: target has allocated so far */
+static ssize_t show_allocated(struct aoedev *dev, char *page)
+{
+	return sprintf(page, "%lu\n", dev->rampages << PAGE_SHIFT);
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_allocated = __ATTR(allocated, 0444, show_allocated, NULL);
+
+/* "off", or how many of the allocation bitmap's chunks may hold data */
+static ssize_t show_sparse(struct aoedev *dev, char *page)
+{
+	ssize_t n;
+
+	/* the bitmap is only taken away under lock */
+	spin_lock(&lock);
+	if (dev->alloc)
+		n = sprintf(page, "%d/%lu\n",
+			bitmap_weight(dev->alloc, sparse_bits(dev)), sparse_bits(dev));
+	else
+		n = sprintf(page, "off\n");
+	spin_unlock(&lock);
+	return n;
+}
+
+/*
+ * "1" turns the allocation bitmap on for a file backend, starting from
+ * the file's holes.  "blank" turns it on for any backend, taking the
+ * whole target to be zeros: only for a new or fully discarded device,
+ * since the bitmap isn't kept when it is turned off or the target is
+ * removed.  "0" turns it off.
+ */
+static ssize_t store_sparse(struct aoedev *dev, const char *page, size_t len)
+{
+	unsigned long *map, *old;
+	int blank;
+
+	if (sysfs_streq(page, "0") || sysfs_streq(page, "off")) {
+		if (!mutex_trylock(&ctl_mutex))
+			return restart_syscall();
+		spin_lock(&lock);
+		old = dev->alloc;
+		dev->alloc = NULL;
+		dev->alloc_ready = 0;
+		spin_unlock(&lock);
+		vfree(old);
+		mutex_unlock(&ctl_mutex);
+		return len;
+	}
+	blank = sysfs_streq(page, "blank");
+	if (!blank && !sysfs_streq(page, "1"))
+		return -EINVAL;
+	if (dev->backend == BE_RAM) {
+		eprintk("%d.%d is sparse already.\n", dev->major, dev->minor);
+		return -EINVAL;
+	}
+	if (!blank && dev->backend != BE_FILE) {
+		eprintk("%d.%d: only a blank block device can be sparse; write \"blank\" if it is.\n",
+			dev->major, dev->minor);
+		return -EINVAL;
+	}
+
+	map = vzalloc(BITS_TO_LONGS(sparse_bits(dev)) * sizeof(long));
+	if (!map)
+		return -ENOMEM;
+	if (!mutex_trylock(&ctl_mutex)) {
+		vfree(map);
+		return restart_syscall();
+	}
+	if (dev->alloc) {
+		mutex_unlock(&ctl_mutex);
+		vfree(map);
+		return -EBUSY;
+	}
+	/* writes mark it from here on, and the scan adds what was there */
+	spin_lock(&lock);
+	dev->alloc = map;
+	spin_unlock(&lock);
+	if (!blank)
+		sparse_scan(dev, map);
+	spin_lock(&lock);
+	dev->alloc_ready = 1;
+	spin_unlock(&lock);
+	mutex_unlock(&ctl_mutex);
+	return len;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_sparse = __ATTR(sparse, 0644, show_sparse, store_sparse);
+
+static ssize_t show_model(struct aoedev *dev, char *page)
+{
+	return sprintf(page, "%.*s\n", (int) nelem(dev->model), dev->model);
+}
+
+static ssize_t store_model(struct aoedev *dev, const char *page, size_t len)
+{
+	spncpy(dev->model, page, nelem(dev->model));
+	return 0;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_model = __ATTR(model, 0644, show_model, store_model);
+
+static ssize_t show_sn(struct aoedev *dev, char *page)
+{
+	return sprintf(page, "%.*s\n", (int) nelem(dev->sn), dev->sn);
+}
+
+static ssize_t store_sn(struct aoedev *dev, const char *page, size_t len)
+{
+	spncpy(dev->sn, page, nelem(dev->sn));
+	return 0; 
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_sn = __ATTR(sn, 0644, show_sn, store_sn);
+
+static ssize_t show_tbucket(struct tbucket *tb, char *page)
+{
+	u64 rate;
+
+	spin_lock_bh(&fq_lock);
+	rate = tb->rate;
+	spin_unlock_bh(&fq_lock);
+	return sprintf(page, "%llu\n", rate);
+}
+
+static ssize_t store_tbucket(struct tbucket *tb, const char *page, size_t len)
+{
+	unsigned long long rate;
+	int error;
+
+	error = kstrtoull(page, 0, &rate);
+	if (error)
+		return error;
+	spin_lock_bh(&fq_lock);
+	tb->rate = rate;
+	tb->tokens = 0;
+	tb->stamp = jiffies;
+	spin_unlock_bh(&fq_lock);
+	return len;
+}
+
+static ssize_t show_iops_limit(struct aoedev *dev, char *page)
+{
+	return show_tbucket(&dev->iops, page);
+}
+
+static ssize_t store_iops_limit(struct aoedev *dev, const char *page, size_t len)
+{
+	return store_tbucket(&dev->iops, page, len);
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_iops_limit = __ATTR(iops_limit, 0644, show_iops_limit, store_iops_limit);
+
+static ssize_t show_bw_limit(struct aoedev *dev, char *page)
+{
+	return show_tbucket(&dev->bw, page);
+}
+
+static ssize_t store_bw_limit(struct aoedev *dev, const char *page, size_t len)
+{
+	return store_tbucket(&dev->bw, page, len);
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_bw_limit = __ATTR(bw_limit, 0644, show_bw_limit, store_bw_limit);
+
+static ssize_t show_tree_k(struct aoedev *dev, char *page)
+{
+	return sprintf(page, "%d\n", dev->tree_k);
+}
+
+static ssize_t store_tree_k(struct aoedev *dev, const char *page, size_t len)
+{
+	unsigned int k;
+	int error;
+
+	error = kstrtouint(page, 0, &k);
+	if (error)
+		return error;
+	if (k == 0 || k > TREE_KMAX)
+		return -EINVAL;
+	dev->tree_k = k;
+	return len;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_tree_k = __ATTR(tree_k, 0644, show_tree_k, store_tree_k);
+
+static ssize_t show_paths(struct aoedev *dev, char *page)
+{
+	ssize_t n = 0;
+	int i;
+
+	spin_lock(&lock);
+	for (i = 0; i < dev->npaths; i++)
+		n += scnprintf(page + n, PAGE_SIZE - n, "%s\n", dev->paths[i].nd->name);
+	spin_unlock(&lock);
+	return n;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_paths = __ATTR(paths, 0444, show_paths, NULL);
+
+/* export dev on one more interface */
+static ssize_t store_attach(struct aoedev *dev, const char *page, size_t len)
+{
+	char buf[IFNAMSIZ], *ifname;
+	struct net_device *nd;
+	int error = 0;
+
+	strlcpy(buf, page, sizeof buf);
+	ifname = strim(buf);
+	nd = dev_get_by_name(&init_net, ifname);
+	if (nd == NULL) {
+		eprintk("attach failed: interface %s not found.\n", ifname);
+		return -ENOENT;
+	}
+	dev_put(nd);
+
+	if (!mutex_trylock(&ctl_mutex))
+		return restart_syscall();
+	spin_lock(&lock);
+	if (kvblade_find(dev->major, dev->minor, nd, NULL)) {
+		eprintk("attach failed: device %d.%d already exists on %s.\n",
+			dev->major, dev->minor, ifname);
+		error = -EEXIST;
+	} else if (dev->npaths == NPATHS) {
+		eprintk("attach failed: %d.%d is already on %d interfaces.\n",
+			dev->major, dev->minor, NPATHS);
+		error = -ENOSPC;
+	} else {
+		memset(&dev->paths[dev->npaths], 0, sizeof dev->paths[0]);
+		dev->paths[dev->npaths++].nd = nd;
+		dev->announce = 1;
+	}
+	spin_unlock(&lock);
+	mutex_unlock(&ctl_mutex);
+
+	if (error)
+		return error;
+	schedule_delayed_work(&announce_dwork, 0);
+	return len;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_attach = __ATTR(attach, 0200, NULL, store_attach);
+
+/* stop exporting dev on an interface; the one it is named after stays */
+static ssize_t store_detach(struct aoedev *dev, const char *page, size_t len)
+{
+	char buf[IFNAMSIZ], *ifname;
+	struct aoepath *p;
+	int error = 0;
+
+	strlcpy(buf, page, sizeof buf);
+	ifname = strim(buf);
+
+	if (!mutex_trylock(&ctl_mutex))
+		return restart_syscall();
+	spin_lock(&lock);
+	for (p = dev->paths + 1; p < dev->paths + dev->npaths; p++)
+		if (strcmp(p->nd->name, ifname) == 0)
+			break;
+	if (p == dev->paths + dev->npaths) {
+		eprintk("detach failed: %d.%d is not attached to %s.\n",
+			dev->major, dev->minor, ifname);
+		error = -ENOENT;
+	} else {
+		if (p->cfgskb)
+			dev_kfree_skb(p->cfgskb);
+		*p = dev->paths[--dev->npaths];
+	}
+	spin_unlock(&lock);
+	mutex_unlock(&ctl_mutex);
+
+	return error ? error : len;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_detach = __ATTR(detach, 0200, NULL, store_detach);
+
+/* dev as batch lines that recreate it, for carrying it over a reload */
+/* a state line carrying len bytes of buf in hex */
+static ssize_t state_hex(char *page, ssize_t n, char *what, char *id, u8 *buf, int len)
+{
+	int i;
+
+	n += scnprintf(page + n, PAGE_SIZE - n, "%s %s ", what, id);
+	for (i = 0; i < len; i++)
+		n += scnprintf(page + n, PAGE_SIZE - n, "%02x", buf[i]);
+	n += scnprintf(page + n, PAGE_SIZE - n, "\n");
+	return n;
+}
+
+static ssize_t show_state(struct aoedev *dev, char *page)
+{
+	char id[64];
+	u64 iops, bw;
+	ssize_t n;
+	int i;
+
+	spin_lock(&lock);
+	snprintf(id, sizeof id, "%d %d %s", dev->major, dev->minor, dev->netdev->name);
+	n = scnprintf(page, PAGE_SIZE, "add %s %.*s\n", id, (int) nelem(dev->path), dev->path);
+	for (i = 1; i < dev->npaths; i++)
+		n += scnprintf(page + n, PAGE_SIZE - n, "attach %s %s\n",
+			id, dev->paths[i].nd->name);
+	spin_unlock(&lock);
+	if (dev->nconfig)
+		n = state_hex(page, n, "config", id, dev->config, dev->nconfig);
+	n = state_hex(page, n, "model", id, (u8 *) dev->model, nelem(dev->model));
+	n = state_hex(page, n, "sn", id, (u8 *) dev->sn, nelem(dev->sn));
+	spin_lock_bh(&fq_lock);
+	iops = dev->iops.rate;
+	bw = dev->bw.rate;
+	spin_unlock_bh(&fq_lock);
+	n += scnprintf(page + n, PAGE_SIZE - n, "iops_limit %s %llu\n", id, iops);
+	n += scnprintf(page + n, PAGE_SIZE - n, "bw_limit %s %llu\n", id, bw);
+	n += scnprintf(page + n, PAGE_SIZE - n, "tree_k %s %d\n", id, dev->tree_k);
+	return n;
+}
+
+static struct kvblade_sysfs_entry kvblade_sysfs_state = __ATTR(state, 0444, show_state, NULL);
+
+static struct attribute *kvblade_ktype_attrs[] = {
+	&kvblade_sysfs_scnt.attr,
+	&kvblade_sysfs_bdev.attr,
+	&kvblade_sysfs_bpath.attr,
+	&kvblade_sysfs_allocated.attr,
+	&kvblade_sysfs_sparse.attr,
+	&kvblade_sysfs_model.attr,
+	&kvblade_sysfs_sn.attr,
+	&kvblade_sysfs_iops_limit.attr,
+	&kvblade_sysfs_bw_limit.attr,
+	&kvblade_sysfs_bufcnt.attr,
+	&kvblade_sysfs_tree_k.attr,
+	&kvblade_sysfs_paths.attr,
+	&kvblade_sysfs_attach.attr,
+	&kvblade_sysfs_detach.attr,
+	&kvblade_sysfs_state.attr,
+	NULL,
+};
+
+static struct attribute *kvblade_ktype_ops_attrs[] = {
+	&kvblade_sysfs_add.attr,
+	&kvblade_sysfs_del.attr,
+	&kvblade_sysfs_batch.attr,
+	&kvblade_sysfs_stats.attr,
+	NULL,
+};
+
+static ssize_t kvblade_attr_show(struct kobject *kobj, struct attribute *attr, char *page)
+{
+	struct kvblade_sysfs_entry *entry;
+	struct aoedev *dev;
+
+	entry = container_of(attr, struct kvblade_sysfs_entry, attr);
+	dev = container_of(kobj, struct aoedev, kobj);
+
+	if (!entry->show)
+		return -EIO;
+
+	return entry->show(dev, page);
+}
+
+static ssize_t kvblade_attr_store(struct kobject *kobj, struct attribute *attr,
+			const char *page, size_t length)
+{
+	ssize_t ret;
+	struct kvblade_sysfs_entry *entry;
+
+	entry = container_of(attr, struct kvblade_sysfs_entry, attr);
+
+	if (kobj == &kvblade_kobj)
+		ret = entry->store(NULL, page, length);
+	else {
+		struct aoedev *dev = container_of(kobj, struct aoedev, kobj);
+
+		if (!entry->store)
+			return -EIO;
+
+		ret = entry->store(dev, page, length);
+	}
+
+	return ret;
+}
+
+static const struct sysfs_ops kvblade_sysfs_ops = {
+	.show		= kvblade_attr_show,
+	.store		= kvblade_attr_store,
+};
+
+static struct kobj_type kvblade_ktype = {
+	.default_attrs	= kvblade_ktype_attrs,
+	.sysfs_ops		= &kvblade_sysfs_ops,
+	.release		= kvblade_release,
+};
+
+static struct kobj_type kvblade_ktype_ops = {
+	.default_attrs	= kvblade_ktype_ops_attrs,
+	.sysfs_ops		= &kvblade_sysfs_ops,
+	.release		= kvblade_release,
+};
+
+
+static void setfld(u16 *a, int idx, int len, char *str)
+{
+	u8 *p;
+
+	for (p = (u8*)(a + idx); len; p += 2, len -= 2) {
+		p[1] = *str ? *str++ : ' ';
+		p[0] = *str ? *str++ : ' ';
+	}
+}
+
+/* whether the backend can take a TRIM */
+static int trim_ok(struct aoedev *d)
+{
+	switch (d->backend) {
+	case BE_BDEV:
+		return blk_queue_discard(bdev_get_queue(d->blkdev));
+	case BE_FILE:
+		return d->filp->f_op->fallocate != NULL;
+	}
+	return 1;
+}
+
+/*
+ * DATA SET MANAGEMENT with the TRIM bit carries scnt blocks of range
+ * entries, each a little endian 48 bit LBA and 16 bit sector count.
+ * Entries with a zero count are padding.
+ */
+enum {
+	TRIM_PERBLK = 512 / 8,
+};
+
+static int trim_range(struct aoe_datahdr *dh, int i, sector_t *lba, ulong *cnt)
+{
+	u64 e = le64_to_cpu(((__le64 *) dh->data)[i]);
+
+	*lba = e & 0x0000FFFFFFFFFFFFULL;
+	*cnt = e >> 48;
+	return *cnt != 0;
+}
+
+/*
+ * Whether writes can sit in a volatile cache below us until a flush,
+ * which IDENTIFY reports as the write cache being on.
+ */
+static int wcache(struct aoedev *d)
+{
+	switch (d->backend) {
+	case BE_BDEV:
+		return (bdev_get_queue(d->blkdev)->flush_flags & REQ_FLUSH) != 0;
+	case BE_FILE:
+		return 1;
+	}
+	return 0;
+}
+
+static int ata_flush_cmd(int cmd)
+{
+	return cmd == ATA_CMD_FLUSH || cmd == ATA_CMD_FLUSH_EXT;
+}
+
+static int ata_fua(int cmd)
+{
+	return cmd == ATA_CMD_WRITE_FUA_EXT || cmd == ATA_CMD_WRITE_MULTI_FUA_EXT;
+}
+
+static int ata_identify(struct aoedev *d, struct aoe_datahdr *dh)
+{
+	char 	buf[64];
+	u16     *words  = (u16 *)dh->data;
+	u8      *cp;
+	loff_t  scnt;
+
+
+	memset(words, 0, 512);
+
+	words[47] = 0x8000;
+	words[49] = 0x0200;
+	words[50] = 0x4000;
+	words[82] = 0x0020;	/* write cache */
+	words[83] = 0x7400;	/* FLUSH CACHE (EXT), 48 bit */
+	words[84] = 0x4040;	/* WRITE FUA EXT */
+	words[85] = wcache(d) ? 0x0020 : 0;
+	words[86] = 0x3400;
+	words[87] = 0x4040;
+	words[93] = 0x400b;
+	if (trim_ok(d)) {
+		words[105] = 1;		/* blocks of ranges per DSM */
+		words[169] = 0x0001;	/* DSM TRIM */
+	}
+
+	sprintf(buf, "V%d.%d\n", 0, 2);
+	setfld(words, 23,  8, buf);
+	setfld(words, 27, nelem(d->model), d->model);
+	setfld(words, 10, nelem(d->sn), d->sn);
+
+	scnt = d->scnt;
+	cp = (u8 *)&words[100];
+	*cp++ = scnt;
+	*cp++ = (scnt >>= 8);
+	*cp++ = (scnt >>= 8);
+	*cp++ = (scnt >>= 8);
+	*cp++ = (scnt >>= 8);
+	*cp++ = (scnt >>= 8);
+
+	scnt = d->scnt;
+	cp = (u8 *)&words[60];
+
+	if (scnt & ~ATA_LBA28MAX)
+		scnt = ATA_LBA28MAX;
+	*cp++ = scnt;
+	*cp++ = (scnt >>= 8);
+	*cp++ = (scnt >>= 8);
+	*cp++ = (scnt >>= 8) & 0xf;
+
+	return 512;
+}
+
+/* finish a read or write, however it was done, and send the reply */
+static void ata_done(struct aoereq *rq, int error, unsigned int bytes)
+{
+	struct aoedev *d;
+	struct sk_buff *skb;
+	struct aoe_hdr *aoe;
+    struct aoe_datahdr *dh;
+	int len;
+	u32 lat;
+
+	d = rq->d;
+	skb = rq->skb;
+	trace_kvblade_ata_complete(skb, error);
+
+	aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	dh = (struct aoe_datahdr *) aoe->data;
+
+	len = sizeof *aoe + sizeof *dh;
+	if (!error) {
+		if (rq->rw == READ)
+			len += bytes;
+		dh->ata.scnt = 0;
+		dh->ata.cmdstat = ATA_DRDY;
+		dh->ata.errfeat = 0;
+		// should increment lba here, too
+	} else {
+		dprintk(KERN_ERR "I/O error %d on %s\n", error, d->kobj.name);
+		dh->ata.cmdstat = ATA_ERR | ATA_DF;
+		dh->ata.errfeat = ATA_UNC | ATA_ABORTED;
+	}
+
+	/* racy between CPUs, but it's only a hint for bufcnt_work */
+	lat = ktime_us_delta(ktime_get(), rq->start);
+	d->lat8 += lat - (d->lat8 >> 3);
+	atomic_inc(&d->ncomplete);
+
+	skb_trim(skb, len);
+	/* kvblade_drain purges the tags once busy reaches 0 */
+	tag_end(d, skb);
+	rq->skb = NULL;
+	atomic_dec(&d->busy);
+	reply_xmit(skb);
+}
+
+static void ata_io_complete(struct bio *bio, int error)
+{
+	struct aoereq *rq = bio->bi_private;
+	unsigned int bytes = bio->bi_vcnt ? bio->bi_io_vec[0].bv_len : 0;
+
+	if (!error && !bio_flagged(bio, BIO_UPTODATE))
+		error = -EIO;
+	bio_put(bio);
+	ata_done(rq, error, bytes);
+}
+
+/*
+ * BE_FILE reads and writes, one work item each on the unbound file_wq so
+ * a slow file doesn't hold up the kthread.  The page cache does the rest.
+ */
+static void file_work(struct work_struct *w)
+{
+	struct aoereq *rq = container_of(w, struct aoereq, work);
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(rq->skb);
+	struct aoe_datahdr *dh = (struct aoe_datahdr *) aoe->data;
+	struct file *filp = rq->d->filp;
+	size_t n = dh->ata.scnt << 9;
+	loff_t pos = (loff_t) rq->lba << 9;
+	mm_segment_t fs;
+	ssize_t ret;
+	sector_t lba;
+	ulong cnt;
+	int i;
+
+	if (dh->ata.cmdstat == ATA_CMD_DSM) {
+		/* punch holes, as the loop driver does for discards */
+		ret = 0;
+		for (i = 0; i < dh->ata.scnt * TRIM_PERBLK && ret == 0; i++)
+			if (trim_range(dh, i, &lba, &cnt))
+				ret = filp->f_op->fallocate(filp,
+					FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					(loff_t) lba << 9, (loff_t) cnt << 9);
+		ata_done(rq, ret, 0);
+		return;
+	}
+	if (ata_flush_cmd(dh->ata.cmdstat)) {
+		ata_done(rq, vfs_fsync(filp, 0), 0);
+		return;
+	}
+
+	if (rq->rw == WRITE && rq->zero) {
+		ret = filp->f_op->fallocate(filp,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, n);
+		/* not every filesystem with fallocate can punch */
+		if (ret == 0)
+			stat_inc(STAT_ZERO);
+		if (ret != -EOPNOTSUPP) {
+			ata_done(rq, ret, n);
+			return;
+		}
+	}
+
+	fs = get_fs();
+	set_fs(KERNEL_DS);
+	if (rq->rw == WRITE)
+		ret = vfs_write(filp, (char __user *) dh->data, n, &pos);
+	else
+		ret = vfs_read(filp, (char __user *) dh->data, n, &pos);
+	set_fs(fs);
+
+	if (ret >= 0 && ret != n)
+		ret = -EIO;
+	if (ret >= 0 && rq->rw == WRITE && ata_fua(dh->ata.cmdstat))
+		ret = vfs_fsync_range(filp, (loff_t) rq->lba << 9,
+			((loff_t) rq->lba << 9) + n - 1, 1);
+	ata_done(rq, ret < 0 ? ret : 0, n);
+}
+
+/* a free request slot, or NULL when all NREQS are taken */
+static struct aoereq *rq_get(struct aoedev *d)
+{
+	struct aoereq *rq, *e;
+
+	rq = d->reqs;
+	e = rq + nelem(d->reqs);
+	for (; rq<e; rq++)
+		if (rq->skb == NULL)
+			return rq;
+	return NULL;
+}
+
+/* account for a request about to go to the backend */
+static void rq_start(struct aoedev *d, struct aoereq *rq, struct sk_buff *skb)
+{
+	int n;
+
+	rq->d = d;
+	rq->skb = skb;
+	rq->start = ktime_get();
+	n = atomic_inc_return(&d->busy);
+	if (n > d->peak)
+		d->peak = n;
+}
+
+static void trim_put(struct aoereq *rq)
+{
+	if (atomic_dec_and_test(&rq->pending))
+		ata_done(rq, rq->error, 0);
+}
+
+static void trim_io_complete(struct bio *bio, int error)
+{
+	struct aoereq *rq = bio->bi_private;
+
+	if (error)
+		rq->error = error;
+	bio_put(bio);
+	trim_put(rq);
+}
+
+/* discards on the backing device, no more than it takes at once each */
+static void trim_bdev(struct aoedev *d, struct aoereq *rq)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(rq->skb);
+	struct aoe_datahdr *dh = (struct aoe_datahdr *) aoe->data;
+	ulong lim = bdev_get_queue(d->blkdev)->limits.max_discard_sectors;
+	struct bio *bio;
+	sector_t lba;
+	ulong cnt, n;
+	int i;
+
+	atomic_set(&rq->pending, 1);
+	rq->error = 0;
+	for (i = 0; i < dh->ata.scnt * TRIM_PERBLK; i++) {
+		if (!trim_range(dh, i, &lba, &cnt))
+			continue;
+		for (; cnt; lba += n, cnt -= n) {
+			n = lim ? min(cnt, lim) : cnt;
+			bio = bio_alloc(GFP_ATOMIC, 0);
+			if (bio == NULL) {
+				rq->error = -ENOMEM;
+				goto out;
+			}
+			bio->bi_sector = lba;
+			bio->bi_size = n << 9;
+			bio->bi_bdev = d->blkdev;
+			bio->bi_end_io = trim_io_complete;
+			bio->bi_private = rq;
+			atomic_inc(&rq->pending);
+			submit_bio(WRITE | REQ_DISCARD, bio);
+		}
+	}
+out:
+	trim_put(rq);
+}
+
+static struct sk_buff *ata_trim(struct aoedev *d, struct sk_buff *skb, int rlen)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoe_datahdr *dh = (struct aoe_datahdr *) aoe->data;
+	struct aoereq *rq;
+	sector_t lba;
+	ulong cnt;
+	int i, len = sizeof *aoe + sizeof *dh;
+
+	if (!(dh->ata.errfeat & ATA_DSM_TRIM) || !trim_ok(d) ||
+		rlen < len + dh->ata.scnt * 512) {
+		dh->ata.cmdstat = ATA_ERR;
+		dh->ata.errfeat = ATA_ABORTED;
+		goto reply;
+	}
+	for (i = 0; i < dh->ata.scnt * TRIM_PERBLK; i++)
+		if (trim_range(dh, i, &lba, &cnt) && lba + cnt > d->scnt) {
+			dh->ata.cmdstat = ATA_ERR;
+			dh->ata.errfeat = ATA_IDNF;
+			goto reply;
+		}
+
+	if (d->backend == BE_RAM) {
+		for (i = 0; i < dh->ata.scnt * TRIM_PERBLK; i++)
+			if (trim_range(dh, i, &lba, &cnt))
+				ram_discard(d, lba, cnt);
+		dh->ata.cmdstat = ATA_DRDY;
+		dh->ata.errfeat = 0;
+		goto reply;
+	}
+
+	rq = rq_get(d);
+	if (rq == NULL) {
+		stat_inc(STAT_NOREQ);
+		busy(d, skb);
+		return NULL;
+	}
+	rq->rw = WRITE;
+	rq_start(d, rq, skb);
+	trace_kvblade_ata_submit(skb, 0, WRITE);
+	if (d->backend == BE_FILE)
+		queue_work(file_wq, &rq->work);
+	else
+		trim_bdev(d, rq);
+	return NULL;
+reply:
+	skb_trim(skb, len);
+	return skb;
+}
+
+/* FLUSH CACHE: empty the backend's write cache, if it has one */
+static struct sk_buff *ata_flush(struct aoedev *d, struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoe_datahdr *dh = (struct aoe_datahdr *) aoe->data;
+	struct aoereq *rq;
+	struct bio *bio = NULL;
+
+	if (!wcache(d)) {
+		dh->ata.cmdstat = ATA_DRDY;
+		dh->ata.errfeat = 0;
+		skb_trim(skb, sizeof *aoe + sizeof *dh);
+		return skb;
+	}
+	rq = rq_get(d);
+	if (rq && d->backend == BE_BDEV) {
+		bio = bio_alloc(GFP_ATOMIC, 0);
+		if (bio == NULL) {
+			stat_inc(STAT_NOMEM);
+			rq = NULL;
+		}
+	} else if (rq == NULL)
+		stat_inc(STAT_NOREQ);
+	if (rq == NULL) {
+		busy(d, skb);
+		return NULL;
+	}
+	rq->rw = WRITE;
+	rq_start(d, rq, skb);
+	trace_kvblade_ata_submit(skb, 0, WRITE);
+	if (bio) {
+		bio->bi_bdev = d->blkdev;
+		bio->bi_end_io = ata_io_complete;
+		bio->bi_private = rq;
+		submit_bio(WRITE_FLUSH, bio);
+	} else
+		queue_work(file_wq, &rq->work);
+	return NULL;
+}
+
+static bool zero_detect = 1;
+module_param(zero_detect, bool, 0644);
+MODULE_PARM_DESC(zero_detect, "write all-zero sectors as write-same, discard or a hole punch");
+
+/*
+ * How a block device can be given bcnt bytes of zeros at lba without
+ * the zeros: a WRITE SAME of one zero sector, or a discard if the device
+ * reads discarded sectors back as zeros and the range is whole
+ * discard granules.  0 means write them after all.
+ */
+static int zero_how(struct aoedev *d, sector_t lba, ulong bcnt)
+{
+	struct request_queue *q = bdev_get_queue(d->blkdev);
+	unsigned int gran = max(q->limits.discard_granularity, 512U);
+
+	if (bcnt >> 9 <= q->limits.max_write_same_sectors)
+		return REQ_WRITE_SAME;
+	if (blk_queue_discard(q) && q->limits.discard_zeroes_data &&
+		bcnt >> 9 <= q->limits.max_discard_sectors &&
+		((u64) lba << 9) % gran == 0 && bcnt % gran == 0)
+		return REQ_DISCARD;
+	return 0;
+}
+
+static inline loff_t readlba(u8 *lba)
+{
+	loff_t n = 0ULL;
+	int i;
+
+	for (i=5; i>=0; i--) {
+		n <<= 8;
+		n |= lba[i];
+	}
+	return n;
+}
+
+/* skb is the reply made from a request of rlen bytes, as long as the MTU */
+static struct sk_buff * ata(struct aoedev *d, struct sk_buff *skb, int rlen)
+{
+	struct aoe_hdr *aoe;
+    struct aoe_datahdr *dh;
+	struct aoereq *rq;
+	struct bio *bio;
+	sector_t lba;
+	int len, rw, fua = 0, zero, how = 0;
+	struct page *page;
+	ulong bcnt, offset;
+
+	aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	dh = (struct aoe_datahdr *) aoe->data;
+	lba = readlba(dh->ata.lba);
+	len = sizeof *aoe + sizeof *dh;
+	switch (dh->ata.cmdstat) {
+	do {
+	case ATA_CMD_PIO_READ:
+		lba &= ATA_LBA28MAX;
+	case ATA_CMD_PIO_READ_EXT:
+		lba &= 0x0000FFFFFFFFFFFFULL;
+		rw = READ;
+		break;
+	case ATA_CMD_PIO_WRITE:
+		lba &= ATA_LBA28MAX;
+	case ATA_CMD_PIO_WRITE_EXT:
+		lba &= 0x0000FFFFFFFFFFFFULL;
+		rw = WRITE;
+		break;
+	case ATA_CMD_WRITE_FUA_EXT:
+	case ATA_CMD_WRITE_MULTI_FUA_EXT:
+		lba &= 0x0000FFFFFFFFFFFFULL;
+		rw = WRITE;
+		fua = REQ_FUA;
+	} while (0);
+		if ((lba + dh->ata.scnt) > d->scnt) {
+			printk(KERN_ERR "sector I/O is out of range: %Lu (%d), max %Lu\n",
+				(long long) lba, dh->ata.scnt, d->scnt);
+			dh->ata.cmdstat = ATA_ERR;
+			dh->ata.errfeat = ATA_IDNF;
+			break;
+		}
+		bcnt = dh->ata.scnt << 9;
+		/* a write's data must have come, a read's must fit */
+		if (len + bcnt > (rw == WRITE ? rlen : skb->len)) {
+			dh->ata.cmdstat = ATA_ERR;
+			dh->ata.errfeat = ATA_ABORTED;
+			break;
+		}
+		zero = rw == WRITE && !fua && zero_detect && bcnt &&
+			memchr_inv(dh->data, 0, bcnt) == NULL;
+		if (d->alloc && d->alloc_ready && (rw == READ || zero) &&
+			!sparse_any(d, lba, dh->ata.scnt)) {
+			/* never written, so it is zeros already */
+			stat_inc(STAT_SPARSE);
+			if (zero)
+				stat_inc(STAT_ZERO);
+			if (rw == READ) {
+				memset(dh->data, 0, bcnt);
+				len += bcnt;
+			}
+			dh->ata.scnt = 0;
+			dh->ata.cmdstat = ATA_DRDY;
+			dh->ata.errfeat = 0;
+			break;
+		}
+		if (d->alloc && rw == WRITE && !zero)
+			sparse_mark(d->alloc, lba, dh->ata.scnt);
+		if (d->backend == BE_RAM) {
+			if (zero) {
+				ram_discard(d, lba, dh->ata.scnt);
+				stat_inc(STAT_ZERO);
+			}
+			if (ram_copy(d, rw, lba, dh->data, bcnt)) {
+				dh->ata.cmdstat = ATA_ERR | ATA_DF;
+				dh->ata.errfeat = ATA_UNC | ATA_ABORTED;
+				break;
+			}
+			if (rw == READ)
+				len += bcnt;
+			dh->ata.scnt = 0;
+			dh->ata.cmdstat = ATA_DRDY;
+			dh->ata.errfeat = 0;
+			break;
+		}
+		rq = rq_get(d);
+		if (rq == NULL) {
+			stat_inc(STAT_NOREQ);
+			busy(d, skb);
+			return NULL;
+		}
+		rq->rw = rw;
+		rq->lba = lba;
+		rq->zero = zero && d->backend == BE_FILE && d->filp->f_op->fallocate;
+		if (d->backend == BE_FILE)
+			goto submit;
+		
+		bio = bio_alloc(GFP_ATOMIC, 1);
+		if (bio == NULL) {
+			eprintk("can't alloc bio\n");
+			stat_inc(STAT_NOMEM);
+			busy(d, skb);
+			return NULL;
+		}
+		rq->bio = bio;
+
+		bio->bi_sector = lba;
+		bio->bi_bdev = d->blkdev;
+		bio->bi_end_io = ata_io_complete;
+		bio->bi_private = rq;
+
+		if (zero)
+			how = zero_how(d, lba, bcnt);
+		if (how)
+			stat_inc(STAT_ZERO);
+		if (how == REQ_WRITE_SAME) {
+			/* as blkdev_issue_write_same builds them */
+			bio->bi_vcnt = 1;
+			bio->bi_io_vec[0].bv_page = ZERO_PAGE(0);
+			bio->bi_io_vec[0].bv_offset = 0;
+			bio->bi_io_vec[0].bv_len = 512;
+			bio->bi_size = bcnt;
+			goto submit;
+		}
+		if (how == REQ_DISCARD) {
+			bio->bi_size = bcnt;
+			goto submit;
+		}
+
+		page = virt_to_page(dh->data);
+		offset = offset_in_page(dh->data);
+
+		if (bio_add_page(bio, page, bcnt, offset) < bcnt) {
+			eprintk(KERN_ERR "Can't bio_add_page for %d sectors\n", dh->ata.scnt);
+			bio_put(bio);
+			goto drop;
+		}
+	submit:
+		rq_start(d, rq, skb);
+		trace_kvblade_ata_submit(skb, lba, rw);
+		if (d->backend == BE_FILE)
+			queue_work(file_wq, &rq->work);
+		else
+			submit_bio(rw | fua | how, bio);
+		return NULL;
+	case ATA_CMD_DSM:
+		return ata_trim(d, skb, rlen);
+	default:
+		eprintk(KERN_ERR "Unknown ATA command 0x%02X\n", dh->ata.cmdstat);
+		dh->ata.cmdstat = ATA_ERR;
+		dh->ata.errfeat = ATA_ABORTED;
+		break;
+	case ATA_CMD_FLUSH:
+	case ATA_CMD_FLUSH_EXT:
+		return ata_flush(d, skb);
+	case ATA_CMD_ID_ATA:
+		len += ata_identify(d, dh);
+		dh->ata.cmdstat = ATA_DRDY;
+		dh->ata.errfeat = 0;
+		break;
+	}
+	skb_trim(skb, len);
+	return skb;
+drop:
+	tag_cancel(d, aoe->dst, aoe->tag);
+	dev_kfree_skb(skb);
+	return NULL;
+}
+
+/*
+ * Copy offload.  A copy runs in the background on copy_wq, COPY_PAGES
+ * pages at a time, from any target exported on the interface the request
+ * came in on to the one it was addressed to.  Both targets are kept
+ * busy while it runs, and deleting either cancels it.  Finished copies
+ * are remembered for COPY_KEEP so that initiators can still ask how
+ * they went.
+ */
+struct aoecopy {
+	struct list_head list;
+	struct work_struct work;
+	u32 id;
+	struct aoedev *src;	/* not to be followed once state is set */
+	struct aoedev *dst;
+	sector_t src_lba;
+	sector_t lba;
+	sector_t cnt;
+	sector_t done;		/* read unlocked, it is only progress */
+	int state;
+	int err;
+	int cancel;
+	unsigned long ended;
+	struct sk_buff *note;	/* sent to the initiator when the copy ends */
+};
+
+static LIST_HEAD(copies);
+static DEFINE_SPINLOCK(copy_lock);
+static u32 copy_id;
+static struct workqueue_struct *copy_wq = NULL;
+
+/* move n sectors between a target and pages, and wait for it */
+static int copy_io(struct aoedev *d, int rw, sector_t lba, struct page **pages, int n)
+{
+	struct bio *bio;
+	mm_segment_t fs;
+	loff_t pos;
+	ssize_t ret;
+	int i, cnt, err = 0;
+
+	switch (d->backend) {
+	case BE_BDEV:
+		/* as many bios as the queue's limits make it take */
+		for (i = 0; n > 0 && !err; ) {
+			bio = bio_alloc(GFP_KERNEL, COPY_PAGES - i);
+			if (bio == NULL)
+				return -ENOMEM;
+			bio->bi_sector = lba;
+			bio->bi_bdev = d->blkdev;
+			for (; n > 0; i++, n -= cnt, lba += cnt) {
+				cnt = min_t(int, n, PAGE_SIZE >> 9);
+				if (bio_add_page(bio, pages[i], cnt << 9, 0) < cnt << 9)
+					break;
+			}
+			err = submit_bio_wait(rw, bio);
+			bio_put(bio);
+		}
+		break;
+	case BE_FILE:
+		pos = (loff_t) lba << 9;
+		fs = get_fs();
+		set_fs(KERNEL_DS);
+		for (i = 0; n > 0 && !err; i++, n -= cnt) {
+			cnt = min_t(int, n, PAGE_SIZE >> 9);
+			if (rw == WRITE)
+				ret = vfs_write(d->filp, (char __user *) page_address(pages[i]), cnt << 9, &pos);
+			else
+				ret = vfs_read(d->filp, (char __user *) page_address(pages[i]), cnt << 9, &pos);
+			if (ret != cnt << 9)
+				err = ret < 0 ? ret : -EIO;
+		}
+		set_fs(fs);
+		break;
+	case BE_RAM:
+		for (i = 0; n > 0 && !err; i++, n -= cnt, lba += cnt) {
+			cnt = min_t(int, n, PAGE_SIZE >> 9);
+			err = ram_copy(d, rw, lba, page_address(pages[i]), cnt << 9);
+		}
+		break;
+	}
+	return err;
+}
+
+static void copy_fill(struct aoecopy *c, struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoe_copyh *ch = (struct aoe_copyh *) aoe->data;
+
+	ch->state = c->state;
+	ch->id = cpu_to_be32(c->id);
+	ch->err = cpu_to_be32((u32) c->err);
+	ch->src_lba = cpu_to_be64(c->src_lba);
+	ch->lba = cpu_to_be64(c->lba);
+	ch->cnt = cpu_to_be64(c->cnt);
+	ch->done = cpu_to_be64(ACCESS_ONCE(c->done));
+}
+
+static void copy_work(struct work_struct *w)
+{
+	struct aoecopy *c = container_of(w, struct aoecopy, work);
+	struct aoedev *src = c->src, *dst = c->dst;
+	struct page *pages[COPY_PAGES];
+	struct sk_buff *note;
+	sector_t n;
+	int i, err = 0;
+
+	memset(pages, 0, sizeof pages);
+	for (i = 0; i < COPY_PAGES && !err; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (pages[i] == NULL)
+			err = -ENOMEM;
+	}
+	while (!err && c->done < c->cnt) {
+		if (ACCESS_ONCE(c->cancel)) {
+			err = -ECANCELED;
+			break;
+		}
+		n = min_t(sector_t, c->cnt - c->done, COPY_PAGES * (PAGE_SIZE >> 9));
+		err = copy_io(src, READ, c->src_lba + c->done, pages, n);
+		if (!err) {
+			/* before the data lands, so no read takes it for zeros */
+			spin_lock(&lock);
+			if (dst->alloc)
+				sparse_mark(dst->alloc, c->lba + c->done, n);
+			spin_unlock(&lock);
+			err = copy_io(dst, WRITE, c->lba + c->done, pages, n);
+		}
+		if (!err)
+			c->done += n;
+	}
+	for (i = 0; i < COPY_PAGES; i++)
+		if (pages[i])
+			__free_page(pages[i]);
+
+	spin_lock(&copy_lock);
+	c->err = err;
+	c->state = err == -ECANCELED ? COPYST_CANCELLED :
+		err ? COPYST_FAILED : COPYST_DONE;
+	c->ended = jiffies;
+	note = c->note;
+	c->note = NULL;
+	if (note)
+		copy_fill(c, note);
+	spin_unlock(&copy_lock);
+
+	/* while the targets are busy, so a drain or unload waits for it */
+	if (note) {
+		skb_queue_tail(&skb_outq, note);
+		wake_up(&ktwaitq);
+	}
+	atomic_dec(&src->busy);
+	atomic_dec(&dst->busy);
+}
+
+/* forget copies that ended long enough ago; called under copy_lock */
+static void copy_reap(void)
+{
+	struct aoecopy *c, *n;
+
+	list_for_each_entry_safe(c, n, &copies, list)
+		if (c->state != COPYST_RUNNING &&
+			time_after(jiffies, c->ended + COPY_KEEP)) {
+			list_del(&c->list);
+			kfree(c);
+		}
+}
+
+static void copy_cancel(struct aoedev *d)
+{
+	struct aoecopy *c;
+
+	spin_lock(&copy_lock);
+	list_for_each_entry(c, &copies, list)
+		if (c->state == COPYST_RUNNING && (c->src == d || c->dst == d))
+			c->cancel = 1;
+	spin_unlock(&copy_lock);
+}
+
+/* after copy_wq is gone */
+static void copy_purge(void)
+{
+	struct aoecopy *c, *n;
+
+	list_for_each_entry_safe(c, n, &copies, list) {
+		list_del(&c->list);
+		if (c->note)
+			dev_kfree_skb(c->note);
+		kfree(c);
+	}
+}
+
+/* called under lock, so the source target can't go away */
+static int copy_start(struct aoedev *d, struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoe_copyh *ch = (struct aoe_copyh *) aoe->data;
+	struct aoedev *src;
+	struct aoecopy *c, *o;
+	sector_t src_lba, lba, cnt;
+	int n = 0;
+
+	for (src = devlist; src; src = src->next)
+		if (src->major == be16_to_cpu(ch->src_major) &&
+			src->minor == ch->src_minor &&
+			kvblade_path(src, skb->dev))
+			break;
+	if (src == NULL)
+		return -ENODEV;
+
+	src_lba = be64_to_cpu(ch->src_lba);
+	lba = be64_to_cpu(ch->lba);
+	cnt = be64_to_cpu(ch->cnt);
+	if (cnt == 0 || cnt > src->scnt || src_lba > src->scnt - cnt ||
+		cnt > d->scnt || lba > d->scnt - cnt)
+		return -EINVAL;
+	if (src == d && src_lba < lba + cnt && lba < src_lba + cnt)
+		return -EINVAL;
+
+	c = kzalloc(sizeof *c, GFP_ATOMIC);
+	if (c == NULL)
+		return -ENOMEM;
+	c->src = src;
+	c->dst = d;
+	c->src_lba = src_lba;
+	c->lba = lba;
+	c->cnt = cnt;
+	c->state = COPYST_RUNNING;
+	INIT_WORK(&c->work, copy_work);
+
+	spin_lock(&copy_lock);
+	copy_reap();
+	list_for_each_entry(o, &copies, list)
+		if (o->state == COPYST_RUNNING)
+			n++;
+	if (n >= NCOPIES) {
+		spin_unlock(&copy_lock);
+		kfree(c);
+		return -EBUSY;
+	}
+	c->id = ++copy_id;
+	copy_fill(c, skb);
+	c->note = skb_copy(skb, GFP_ATOMIC);
+	list_add_tail(&c->list, &copies);
+	spin_unlock(&copy_lock);
+
+	atomic_inc(&src->busy);
+	atomic_inc(&d->busy);
+	queue_work(copy_wq, &c->work);
+	return 0;
+}
+
+static struct sk_buff *copycmd(struct aoedev *d, struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoe_copyh *ch = (struct aoe_copyh *) aoe->data;
+	struct aoecopy *c;
+	int err = 0;
+
+	if (skb->len < sizeof *aoe + sizeof *ch) {
+		err = AOEERR_ARG;
+		goto out;
+	}
+	if (ch->ver != COPY_VER) {
+		err = AOEERR_VER;
+		goto out;
+	}
+	skb_trim(skb, sizeof *aoe + sizeof *ch);
+
+	switch (ch->op) {
+	case COPYOP_START:
+		switch (copy_start(d, skb)) {
+		case 0:
+			break;
+		case -ENODEV:
+			err = AOEERR_DEV;
+			break;
+		case -EBUSY:
+		case -ENOMEM:
+			err = AOEERR_BUSY;
+			break;
+		default:
+			err = AOEERR_ARG;
+		}
+		break;
+	case COPYOP_STATUS:
+	case COPYOP_CANCEL:
+		spin_lock(&copy_lock);
+		list_for_each_entry(c, &copies, list)
+			if (c->id == be32_to_cpu(ch->id) && c->dst == d)
+				break;
+		if (&c->list == &copies)
+			err = AOEERR_ARG;
+		else {
+			if (ch->op == COPYOP_CANCEL)
+				c->cancel = 1;
+			copy_fill(c, skb);
+		}
+		spin_unlock(&copy_lock);
+		break;
+	default:
+		err = AOEERR_ARG;
+	}
+out:
+	if (err) {
+		aoe->verfl |= AOEFL_ERR;
+		aoe->err = err;
+		skb_trim(skb, sizeof *aoe);
+	}
+	return skb;
+}
+
+static struct sk_buff* cfg(struct aoedev *d, struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe;
+	struct aoe_cfghdr *cfg;
+	int len, cslen, ccmd;
+
+	aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	cfg = (struct aoe_cfghdr *) aoe->data;
+	cslen = ntohs(cfg->cslen);
+	ccmd = cfg->aoeccmd & 0xf;
+	len = sizeof *aoe;
+
+	cfg->bufcnt = htons(d->bufcnt);
+	cfg->scnt = MAXSECTORS(skb->dev->mtu);
+	cfg->fwver = __constant_htons(0x0002);
+	cfg->aoeccmd = AOE_HVER;
+
+	if (cslen > nelem(d->config))
+		goto drop;
+
+	switch (ccmd) {
+	case AOECCMD_TEST:
+		if (d->nconfig != cslen)
+			goto drop;
+		// fall thru
+	case AOECCMD_PTEST:
+		if (cslen > d->nconfig)
+			goto drop;
+		if (memcmp(cfg->data, d->config, cslen) != 0)
+			goto drop;
+		// fall thru
+	case AOECCMD_READ:
+		cfg->cslen = cpu_to_be16(d->nconfig);
+		memcpy(cfg->data, d->config, d->nconfig);
+		len += sizeof *cfg + d->nconfig;
+		break;
+	case AOECCMD_SET:
+		if (d->nconfig)
+		if (d->nconfig != cslen || memcmp(cfg->data, d->config, cslen) != 0) {
+			aoe->verfl |= AOEFL_ERR;
+			aoe->err = AOEERR_CFG;
+			break;
+		}
+		// fall thru
+	case AOECCMD_FSET:
+		d->nconfig = cslen;
+		memcpy(d->config, cfg->data, cslen);
+		cfg_invalidate(d);
+		len += sizeof *cfg + cslen;
+		break;
+	default:
+		aoe->verfl |= AOEFL_ERR;
+		aoe->err = AOEERR_ARG;
+	}
+	skb_trim(skb, len);
+	return skb;
+drop:
+	dev_kfree_skb(skb);
+	return NULL;
+}
+
+
+
+static __always_inline void set_errcode(struct aoe_datahdr *dh, int errcode)
+{
+    memcpy(dh->data, &errcode, sizeof(int));
+}
+
+
+/*
+ * What we know of each tree, for TREEOP_STAT when the backend can't say.
+ * Trees belong to clydefscore, not to a target, so this is global.
+ */
+struct treestat {
+    struct hlist_node node;
+    u64 tid;
+    u64 nodes;
+    u64 bytes;
+    int k;
+};
+
+static struct hlist_head treestats[NTREEHASH];
+static DEFINE_SPINLOCK(treestat_lock);
+
+static struct treestat *treestat_find(u64 tid)
+{
+    struct treestat *ts;
+
+    hlist_for_each_entry(ts, &treestats[hash_64(tid, ilog2(NTREEHASH))], node)
+        if (ts->tid == tid)
+            return ts;
+    return NULL;
+}
+
+static void treestat_create(u64 tid, int k)
+{
+    struct treestat *ts = kzalloc(sizeof(*ts), GFP_KERNEL);
+
+    if (!ts)
+        return;
+    ts->tid = tid;
+    ts->k = k;
+    spin_lock(&treestat_lock);
+    hlist_add_head(&ts->node, &treestats[hash_64(tid, ilog2(NTREEHASH))]);
+    spin_unlock(&treestat_lock);
+}
+
+static void treestat_remove(u64 tid)
+{
+    struct treestat *ts;
+
+    spin_lock(&treestat_lock);
+    ts = treestat_find(tid);
+    if (ts)
+        hlist_del(&ts->node);
+    spin_unlock(&treestat_lock);
+    kfree(ts);
+}
+
+/*trees made before we were loaded are picked up on their first insert*/
+static void treestat_add(u64 tid, s64 nodes, s64 bytes)
+{
+    struct treestat *ts, *nts = NULL;
+
+    spin_lock(&treestat_lock);
+    ts = treestat_find(tid);
+    if (!ts && nodes > 0) {
+        spin_unlock(&treestat_lock);
+        nts = kzalloc(sizeof(*nts), GFP_KERNEL);
+        if (!nts)
+            return;
+        nts->tid = tid;
+        spin_lock(&treestat_lock);
+        ts = treestat_find(tid);
+        if (!ts) {
+            hlist_add_head(&nts->node, &treestats[hash_64(tid, ilog2(NTREEHASH))]);
+            ts = nts;
+            nts = NULL;
+        }
+    }
+    if (ts) {
+        ts->nodes += nodes;
+        ts->bytes += bytes;
+    }
+    spin_unlock(&treestat_lock);
+    kfree(nts);
+}
+
+static int treestat_get(u64 tid, struct aoe_treestat *as)
+{
+    struct clydefscore_tree_stat st;
+    typeof(&clydefscore_tree_stat) stat;
+    struct treestat *ts;
+    int err = -ENOENT;
+
+    memset(&st, 0, sizeof(st));
+    stat = symbol_get(clydefscore_tree_stat);
+    if (stat) {
+        err = stat(tid, &st);
+        symbol_put(clydefscore_tree_stat);
+    } else {
+        spin_lock(&treestat_lock);
+        ts = treestat_find(tid);
+        if (ts) {
+            st.nodes = ts->nodes;
+            st.bytes = ts->bytes;
+            st.k = ts->k;
+            err = 0;
+        }
+        spin_unlock(&treestat_lock);
+    }
+    if (err)
+        return err;
+
+    memset(as, 0, sizeof(*as));
+    as->nodes = cpu_to_be64(st.nodes);
+    as->bytes = cpu_to_be64(st.bytes);
+    as->depth = cpu_to_be32(st.depth);
+    as->k = st.k;
+    return 0;
+}
+
+static void treestat_purge(void)
+{
+    struct hlist_node *n;
+    struct treestat *ts;
+    int i;
+
+    for (i = 0; i < nelem(treestats); i++)
+        hlist_for_each_entry_safe(ts, n, &treestats[i], node) {
+            hlist_del(&ts->node);
+            kfree(ts);
+        }
+}
+
+/*
+ * LZ4 for tree payloads, through the crypto API.  A client sets
+ * TREEOPFL_LZ4 on an op to say it takes a compressed READ reply or sends
+ * compressed UPDATE data; a target without lz4 just answers reads plainly.
+ * The lz4 tfm keeps its working memory in the tfm and compresses into a
+ * worst-case sized buffer, so each CPU has its own of both.
+ */
+struct treelz4 {
+    struct crypto_comp *tfm;
+    unsigned char *buf;     /*TREELZ4_BUF bytes*/
+};
+
+static DEFINE_PER_CPU(struct treelz4, treelz4s);
+static int treelz4_ok;
+
+static bool tree_compress = 1;
+module_param(tree_compress, bool, 0644);
+MODULE_PARM_DESC(tree_compress, "compress tree read replies for clients that take lz4");
+
+static void treelz4_exit(void)
+{
+    struct treelz4 *z;
+    int cpu;
+
+    treelz4_ok = 0;
+    for_each_possible_cpu(cpu) {
+        z = per_cpu_ptr(&treelz4s, cpu);
+        if (!IS_ERR_OR_NULL(z->tfm))
+            crypto_free_comp(z->tfm);
+        vfree(z->buf);
+        z->tfm = NULL;
+        z->buf = NULL;
+    }
+}
+
+static void treelz4_init(void)
+{
+    struct treelz4 *z;
+    int cpu;
+
+    if (!crypto_has_comp("lz4", 0, 0)) {
+        iprintk("no lz4, tree payloads go uncompressed\n");
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        z = per_cpu_ptr(&treelz4s, cpu);
+        z->tfm = crypto_alloc_comp("lz4", 0, 0);
+        z->buf = vmalloc(TREELZ4_BUF);
+        if (IS_ERR(z->tfm) || !z->buf) {
+            eprintk("can't set up lz4, tree payloads go uncompressed\n");
+            treelz4_exit();
+            return;
+        }
+    }
+    treelz4_ok = 1;
+}
+
+/**
+ * Compress len bytes of src into dst, if that makes them smaller.
+ * @return bytes put in dst, 0 if they weren't compressed
+ */
+static int treelz4_compress(const void *src, unsigned int len, void *dst, unsigned int room)
+{
+    struct treelz4 *z;
+    unsigned int dlen = TREELZ4_BUF;
+    int n = 0;
+
+    if (!treelz4_ok || !tree_compress || len > TREELZ4_MAX)
+        return 0;
+    z = &get_cpu_var(treelz4s);
+    if (!crypto_comp_compress(z->tfm, src, len, z->buf, &dlen) &&
+            dlen < len && dlen <= room) {
+        memcpy(dst, z->buf, dlen);
+        n = dlen;
+    }
+    put_cpu_var(treelz4s);
+    return n;
+}
+
+/**
+ * Decompress len bytes of src.
+ * @param out set to a buffer of *olen bytes the caller must kfree
+ */
+static int treelz4_decompress(const void *src, unsigned int len, void **out, u32 *olen)
+{
+    struct treelz4 *z;
+    unsigned int dlen = TREELZ4_MAX;
+    void *buf;
+    int err;
+
+    if (!treelz4_ok)
+        return -EOPNOTSUPP;
+    buf = kmalloc(TREELZ4_MAX, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    z = &get_cpu_var(treelz4s);
+    err = crypto_comp_decompress(z->tfm, src, len, buf, &dlen);
+    put_cpu_var(treelz4s);
+    if (err) {
+        kfree(buf);
+        return -EINVAL;
+    }
+    *out = buf;
+    *olen = dlen;
+    return 0;
+}
+
+/**
+ * TREEOP_READ for a client that takes lz4: the reply is compressed
+ * when that makes it smaller, so len may be more than fits in room.
+ * @return bytes put in data, or a negative error
+ */
+static int tree_read_lz4(u64 tid, u64 nid, u32 off, u32 len,
+        unsigned char *data, int room, unsigned char *rflags)
+{
+    void *buf;
+    int n, err;
+
+    if (len > TREELZ4_MAX)
+        return -EMSGSIZE;
+    buf = kmalloc(len, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    err = clydefscore_node_read(tid, nid, off, len, buf);
+    if (!err) {
+        n = treelz4_compress(buf, len, data, room);
+        if (n)
+            *rflags |= TREEOPFL_LZ4;
+        else if (len <= room) {
+            memcpy(data, buf, len);
+            n = len;
+        } else
+            err = -EMSGSIZE;
+    }
+    kfree(buf);
+    return err ? err : n;
+}
+
+/**
+ * Copy len bytes at off from one node to another, inside the target.
+ * @note runs in tree work, so it may sleep; the two nodes may be on
+ *       different treeqs, so the copy isn't ordered against the target.
+ */
+static int tree_copy(u64 tid, u64 nid, u64 dtid, u64 dnid, u32 off, u32 len)
+{
+    void *buf;
+    u32 done, n;
+    int err = 0;
+
+    buf = kmalloc(TREECOPY_CHUNK, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    for (done = 0; done < len && !err; done += n) {
+        n = min_t(u32, len - done, TREECOPY_CHUNK);
+        err = clydefscore_node_read(tid, nid, off + done, n, buf);
+        if (!err)
+            err = clydefscore_node_write(dtid, dnid, off + done, n, buf);
+    }
+    kfree(buf);
+    return err;
+}
+
+/**
+ * Fill buf with records for the nodes of tid after *cursor.
+ * @param limit most records, 0 for as many as fit in room
+ * @param plen most bytes of each node's data to include
+ * @param count set to the records written
+ * @param more cleared if the end of the tree was reached
+ * @return bytes of buf used, or a negative error
+ * @note the first record is cut short if need be so a scan always
+ *       makes progress.
+ */
+static int tree_scan(u64 tid, u64 *cursor, u32 limit, u32 plen,
+        unsigned char *buf, int room, u32 *count, int *more)
+{
+    typeof(&clydefscore_node_next) next;
+    struct aoe_treerec *rec;
+    u64 nid, nlen;
+    int used = 0, ret = 0;
+    u32 dlen;
+
+    *count = 0;
+    *more = 1;
+    next = symbol_get(clydefscore_node_next);
+    if (!next)
+        return -EOPNOTSUPP;
+
+    while (!limit || *count < limit) {
+        if (room - used < (int) sizeof(*rec))
+            break;
+        ret = next(tid, *cursor, &nid, &nlen);
+        if (ret == 1) {
+            *more = 0;
+            ret = 0;
+            break;
+        }
+        if (ret)
+            break;
+        dlen = min_t(u64, nlen, plen);
+        if (dlen > room - used - sizeof(*rec)) {
+            if (*count)
+                break;
+            dlen = room - used - sizeof(*rec);
+        }
+        rec = (struct aoe_treerec *) (buf + used);
+        memset(rec, 0, sizeof(*rec));
+        rec->nid = cpu_to_be64(nid);
+        rec->len = cpu_to_be32((u32) min_t(u64, nlen, ~0U));
+        if (dlen && (ret = clydefscore_node_read(tid, nid, 0, dlen, rec->data))) {
+            rec->err = cpu_to_be16((u16) ret);
+            dlen = 0;
+            ret = 0;
+        }
+        rec->dlen = cpu_to_be32(dlen);
+        used += sizeof(*rec) + dlen;
+        (*count)++;
+        *cursor = nid;
+    }
+    symbol_put(clydefscore_node_next);
+    return ret ? ret : used;
+}
+
+/**
+ * Fill buf with records for the nodes gets asks for, while they fit.
+ * @return bytes of buf used; count is set to the records written
+ */
+static int tree_mget(u64 tid, struct aoe_treeget *gets, int ngets,
+        unsigned char *buf, int room, u32 *count)
+{
+    struct aoe_treerec *rec;
+    u32 len;
+    int used = 0, err, i;
+
+    for (i = 0; i < ngets; i++) {
+        len = be32_to_cpu(gets[i].len);
+        if (len > room - used || room - used - len < sizeof(*rec))
+            break;
+        rec = (struct aoe_treerec *) (buf + used);
+        memset(rec, 0, sizeof(*rec));
+        rec->nid = gets[i].nid;
+        rec->len = gets[i].len;
+        err = clydefscore_node_read(tid, be64_to_cpu(gets[i].nid),
+            be32_to_cpu(gets[i].off), len, rec->data);
+        if (err) {
+            rec->err = cpu_to_be16((u16) err);
+            len = 0;
+        }
+        rec->dlen = cpu_to_be32(len);
+        used += sizeof(*rec) + len;
+    }
+    *count = i;
+    return used;
+}
+
+/*bytes an op takes up in a request frame*/
+static __always_inline size_t treeop_size(struct aoe_treeop *q)
+{
+    switch (q->op) {
+    case TREEOP_UPDATE:
+    case TREEOP_MGET:
+        return sizeof(*q) + be32_to_cpu(q->len);
+    case TREEOP_COPY:
+        return sizeof(*q) + sizeof(struct aoe_treecopy);
+    }
+    return sizeof(*q);
+}
+
+/**
+ * Run one framed tree operation against the backend.
+ * @param q the request op, holding qlen bytes of frame from q onwards
+ * @param r where the reply op goes, with room bytes of frame from r on.
+ *          q is decoded before r is written, so the two may be the same.
+ * @return the length of the reply op, or -1 if q is truncated
+ */
+static int treeop(struct aoedev *d, struct aoe_treeop *q, int qlen, struct aoe_treeop *r, int room)
+{
+    unsigned char op;
+    u32 len, off;
+    u64 tid, nid, dtid = 0, dnid = 0;
+    struct aoe_treecopy *tc = (struct aoe_treecopy *) q->data;
+    struct aoe_treeget *gets = NULL;
+    int err = 0, rlen = sizeof(*r), more, n;
+    unsigned char qflags, rflags = 0;
+    void *buf;
+
+    if (qlen < sizeof(*q) || qlen < treeop_size(q) || room < sizeof(*r))
+        return -1;
+
+    op = q->op;
+    qflags = q->flags;
+    len = be32_to_cpu(q->len);
+    off = be32_to_cpu(q->off);
+    tid = be64_to_cpu(q->tid);
+    nid = be64_to_cpu(q->nid);
+    if (op == TREEOP_COPY) {
+        dtid = be64_to_cpu(tc->tid);
+        dnid = be64_to_cpu(tc->nid);
+    }
+    /*r may be q, and the records would overwrite the list*/
+    if (op == TREEOP_MGET && len) {
+        gets = kmemdup(q->data, len, GFP_KERNEL);
+        if (!gets)
+            err = -ENOMEM;
+    }
+
+    switch (op) {
+    case TREEOP_CREATE:
+        len = 0;
+        if (off > TREE_KMAX) {
+            err = -EINVAL;
+            break;
+        }
+        if (!off)
+            off = d->tree_k;
+        tid = clydefscore_tree_create(off);
+        if (tid)
+            treestat_create(tid, off);
+        else
+            err = TERR_ALLOC_FAILED;
+        break;
+    case TREEOP_REMOVETREE:
+        err = clydefscore_tree_remove(tid);
+        if (!err)
+            treestat_remove(tid);
+        len = 0;
+        break;
+    case TREEOP_STAT:
+        len = 0;
+        if (room - sizeof(*r) < sizeof(struct aoe_treestat)) {
+            err = -EMSGSIZE;
+            break;
+        }
+        err = treestat_get(tid, (struct aoe_treestat *) r->data);
+        if (!err)
+            len = sizeof(struct aoe_treestat);
+        rlen += len;
+        break;
+    case TREEOP_READ:
+        if (qflags & TREEOPFL_LZ4) {
+            n = tree_read_lz4(tid, nid, off, len, r->data, room - sizeof(*r), &rflags);
+            err = min(n, 0);
+            len = max(n, 0);
+            rlen += len;
+            break;
+        }
+        if (len > room - sizeof(*r)) {
+            err = -EMSGSIZE;
+            len = 0;
+            break;
+        }
+        err = clydefscore_node_read(tid, nid, off, len, r->data);
+        if (err)
+            len = 0;
+        rlen += len;
+        break;
+    case TREEOP_INSERT:
+        err = clydefscore_node_insert(tid, &nid);
+        if (!err)
+            treestat_add(tid, 1, 0);
+        len = 0;
+        break;
+    case TREEOP_UPDATE:
+        if (qflags & TREEOPFL_LZ4) {
+            err = treelz4_decompress(q->data, len, &buf, &len);
+            if (!err) {
+                err = clydefscore_node_write(tid, nid, off, len, buf);
+                kfree(buf);
+            }
+        } else
+            err = clydefscore_node_write(tid, nid, off, len, q->data);
+        if (!err)
+            treestat_add(tid, 0, len);
+        len = 0;
+        break;
+    case TREEOP_REMOVE:
+        err = clydefscore_node_remove(tid, nid);
+        if (!err)
+            treestat_add(tid, -1, 0);
+        len = 0;
+        break;
+    case TREEOP_COPY:
+        err = tree_copy(tid, nid, dtid, dnid, off, len);
+        if (!err)
+            treestat_add(dtid, 0, len);
+        else
+            len = 0;
+        break;
+    case TREEOP_SCAN:
+        n = tree_scan(tid, &nid, off, len, r->data, room - sizeof(*r), &off, &more);
+        if (n < 0) {
+            err = n;
+            n = 0;
+            off = 0;
+        } else if (more)
+            rflags |= TREEOPFL_MORE;
+        len = n;
+        rlen += len;
+        break;
+    case TREEOP_MGET:
+        if (!err && len % sizeof(*gets))
+            err = -EINVAL;
+        if (!err) {
+            len = tree_mget(tid, gets, len / sizeof(*gets),
+                r->data, room - sizeof(*r), &off);
+            rlen += len;
+        } else {
+            len = 0;
+        }
+        break;
+    default:
+        err = -EOPNOTSUPP;
+        len = 0;
+        break;
+    }
 
-		bio->bi_sector = lba;
-		bio->bi_bdev = d->blkdev;
-		bio->bi_end_io = ata_io_complete;
-		bio->bi_private = rq;
+    kfree(gets);
+    r->op = op;
+    r->flags = rflags;
+    r->err = cpu_to_be16((u16) err);
+    r->len = cpu_to_be32(len);
+    r->off = cpu_to_be32(off);
+    r->tid = cpu_to_be64(tid);
+    r->nid = cpu_to_be64(nid);
+    return rlen;
+}
 
-		page = virt_to_page(dh->data);
-		bcnt = dh->ata.scnt << 9;
-		offset = offset_in_page(dh->data);
+static __always_inline void trace_treeop(struct sk_buff *skb, struct aoe_treeop *r)
+{
+    trace_kvblade_treeop(skb, r->op, be64_to_cpu(r->tid), be64_to_cpu(r->nid),
+        be32_to_cpu(r->len), (s16) be16_to_cpu(r->err));
+}
 
-		if (bio_add_page(bio, page, bcnt, offset) < bcnt) {
-			eprintk(KERN_ERR "Can't bio_add_page for %d sectors\n", dh->ata.scnt);
-			bio_put(bio);
-			goto drop;
-		}
+/**
+ * Answer a lone TREEOP_SCAN in as many frames as it takes.
+ * @note every frame but the last goes straight out; the last is
+ *       returned, so it alone is kept for retransmits.
+ */
+static struct sk_buff *treestream(struct aoedev *d, struct sk_buff *skb)
+{
+    struct aoe_hdr *ah = (struct aoe_hdr *) skb_mac_header(skb);
+    struct aoe_treeh *th = (struct aoe_treeh *) ah->data;
+    struct aoe_treeop *q = (struct aoe_treeop *) th->data;
+    int hlen = sizeof(*ah) + sizeof(*th);
+    int room = skb->len - hlen;
+    struct aoe_treeop qc = *q;
+    u32 limit = be32_to_cpu(q->off);
+    struct sk_buff *next;
+    int frames, n;
+
+    for (frames = 1; ; frames++) {
+        n = treeop(d, &qc, sizeof(qc), q, room);
+        trace_treeop(skb, q);
+        th->flags = 0;
+        skb_trim(skb, hlen + n);
+        if (q->err || !(q->flags & TREEOPFL_MORE) || frames == TREESCAN_FRAMES)
+            break;
+        if (limit && (limit -= be32_to_cpu(q->off)) == 0)
+            break;
 
-		rq->skb = skb;
-		atomic_inc(&d->busy);
-		submit_bio(rw, bio);
-		return NULL;
-	default:
-		eprintk(KERN_ERR "Unknown ATA command 0x%02X\n", dh->ata.cmdstat);
-		dh->ata.cmdstat = ATA_ERR;
-		dh->ata.errfeat = ATA_ABORTED;
-		break;
-	case ATA_CMD_ID_ATA:
-		len += ata_identify(d, dh);
-	case ATA_CMD_FLUSH:
-		dh->ata.cmdstat = ATA_DRDY;
-		dh->ata.errfeat = 0;
-		break;
-	}
-	skb_trim(skb, len);
-	return skb;
-drop:
-	dev_kfree_skb(skb);
-	return NULL;
+        next = skb_new(skb->dev, hlen + room);
+        if (!next)
+            break;
+        memcpy(skb_mac_header(next), ah, hlen);
+        qc.nid = q->nid;
+        qc.off = cpu_to_be32(limit);
+        skb_queue_tail(&skb_outq, skb);
+        wake_up(&ktwaitq);
+
+        skb = next;
+        ah = (struct aoe_hdr *) skb_mac_header(skb);
+        th = (struct aoe_treeh *) ah->data;
+        q = (struct aoe_treeop *) th->data;
+    }
+    return skb;
 }
 
-static struct sk_buff* cfg(struct aoedev *d, struct sk_buff *skb)
+/**
+ * Run a framed tree command.  The ops are all checked to be whole before
+ * any of them runs, then run in order; the reply carries one op per op
+ * run.  With TREEFL_STOPERR set, the first op to fail ends the frame.
+ * A single op is answered in place, several need a fresh reply frame as
+ * read replies are bigger than their requests.
+ * @param rlen the length of the request, skb being as long as the MTU
+ * @return the reply, or NULL with skb untouched if none could be made
+ */
+static struct sk_buff *treeframe(struct aoedev *d, struct sk_buff *skb, int rlen)
 {
-	struct aoe_hdr *aoe;
-	struct aoe_cfghdr *cfg;
-	int len, cslen, ccmd;
-
-	aoe = (struct aoe_hdr *) skb_mac_header(skb);
-	cfg = (struct aoe_cfghdr *) aoe->data;
-	cslen = ntohs(cfg->cslen);
-	ccmd = cfg->aoeccmd & 0xf;
-	len = sizeof *aoe;
+    struct aoe_hdr *ah = (struct aoe_hdr *) skb_mac_header(skb);
+    struct aoe_treeh *th = (struct aoe_treeh *) ah->data;
+    struct aoe_treeop *q, *r;
+    struct sk_buff *rskb;
+    struct aoe_treeh *rth;
+    int room = skb->len - sizeof(*ah) - sizeof(*th);
+    int qroom = max_t(int, rlen - sizeof(*ah) - sizeof(*th), 0);
+    int left, rroom, nops, i, n;
+    __be16 err;
+
+    if (th->ver != TREE_VER) {
+        ah->verfl |= AOEFL_ERR;
+        ah->err = AOEERR_VER;
+        th->ver = TREE_VER;
+        skb_trim(skb, sizeof(*ah) + sizeof(*th));
+        return skb;
+    }
 
-	cfg->bufcnt = htons(nelem(d->reqs));
-	cfg->scnt = MAXSECTORS(d->netdev->mtu);
-	cfg->fwver = __constant_htons(0x0002);
-	cfg->aoeccmd = AOE_HVER;
+    nops = be16_to_cpu(th->nops);
+    q = (struct aoe_treeop *) th->data;
+    for (i = 0, left = qroom; i < nops; i++) {
+        if (left < sizeof(*q) || left < treeop_size(q))
+            goto badarg;
+        left -= treeop_size(q);
+        q = (struct aoe_treeop *) ((unsigned char *) q + treeop_size(q));
+    }
 
-	if (cslen > nelem(d->config))
-		goto drop;
+    q = (struct aoe_treeop *) th->data;
+    if (nops == 1 && q->op == TREEOP_SCAN && (th->flags & TREEFL_STREAM))
+        return treestream(d, skb);
+    if (nops == 1) {
+        n = treeop(d, q, qroom, q, room);
+        trace_treeop(skb, q);
+        th->flags = 0;
+        skb_trim(skb, sizeof(*ah) + sizeof(*th) + n);
+        return skb;
+    }
 
-	switch (ccmd) {
-	case AOECCMD_TEST:
-		if (d->nconfig != cslen)
-			goto drop;
-		// fall thru
-	case AOECCMD_PTEST:
-		if (cslen > d->nconfig)
-			goto drop;
-		if (memcmp(cfg->data, d->config, cslen) != 0)
-			goto drop;
-		// fall thru
-	case AOECCMD_READ:
-		cfg->cslen = cpu_to_be16(d->nconfig);
-		memcpy(cfg->data, d->config, d->nconfig);
-		len += sizeof *cfg + d->nconfig;
-		break;
-	case AOECCMD_SET:
-		if (d->nconfig)
-		if (d->nconfig != cslen || memcmp(cfg->data, d->config, cslen) != 0) {
-			aoe->verfl |= AOEFL_ERR;
-			aoe->err = AOEERR_CFG;
-			break;
-		}
-		// fall thru
-	case AOECCMD_FSET:
-		d->nconfig = cslen;
-		memcpy(d->config, cfg->data, cslen);
-		len += sizeof *cfg + cslen;
-		break;
-	default:
-		aoe->verfl |= AOEFL_ERR;
-		aoe->err = AOEERR_ARG;
-	}
-	skb_trim(skb, len);
-	return skb;
-drop:
-	dev_kfree_skb(skb);
-	return NULL;
+    rskb = skb_new(skb->dev, skb->len);
+    if (!rskb)
+        return NULL;
+    memcpy(skb_mac_header(rskb), ah, sizeof(*ah) + sizeof(*th));
+    rth = (struct aoe_treeh *) ((struct aoe_hdr *) skb_mac_header(rskb))->data;
+    r = (struct aoe_treeop *) rth->data;
+
+    left = qroom;
+    rroom = room;
+    for (i = 0; i < nops; ) {
+        /*once the reply is full the rest don't run; the client resends them*/
+        n = treeop(d, q, left, r, rroom);
+        if (n < 0)
+            break;
+        /*
+         * a read that didn't fit what is left of the reply isn't counted
+         * and stops the frame; only the first op of a frame gets told
+         * it can never fit.  Reads change nothing, so it can be undone.
+         */
+        if (i > 0 && r->err == cpu_to_be16((u16) -EMSGSIZE) &&
+                (r->op == TREEOP_READ || r->op == TREEOP_STAT))
+            break;
+        trace_treeop(skb, r);
+        i++;
+        left -= treeop_size(q);
+        q = (struct aoe_treeop *) ((unsigned char *) q + treeop_size(q));
+        rroom -= n;
+        err = r->err;
+        r = (struct aoe_treeop *) ((unsigned char *) r + n);
+        if (err && (th->flags & TREEFL_STOPERR))
+            break;
+    }
+    rth->flags = 0;
+    rth->nops = cpu_to_be16(i);
+    skb_trim(rskb, sizeof(*ah) + sizeof(*th) + (room - rroom));
+    dev_kfree_skb(skb);
+    return rskb;
+
+badarg:
+    ah->verfl |= AOEFL_ERR;
+    ah->err = AOEERR_ARG;
+    skb_trim(skb, sizeof(*ah) + sizeof(*th));
+    return skb;
 }
 
+/*
+ * The backend's asynchronous calls, when it has them.  They are resolved
+ * once at load and held until unload; clydefscore is loaded before us
+ * anyway, since the synchronous calls are linked directly.
+ */
+static typeof(&clydefscore_node_read_async) node_read_async;
+static typeof(&clydefscore_node_write_async) node_write_async;
+static typeof(&clydefscore_node_insert_async) node_insert_async;
 
+static void tree_async_init(void)
+{
+    node_read_async = symbol_get(clydefscore_node_read_async);
+    node_write_async = symbol_get(clydefscore_node_write_async);
+    node_insert_async = symbol_get(clydefscore_node_insert_async);
+    if (node_read_async || node_write_async || node_insert_async)
+        iprintk("tree reads%s, writes%s and inserts%s run asynchronously\n",
+            node_read_async ? "" : " not", node_write_async ? "" : " not",
+            node_insert_async ? "" : " not");
+}
 
-static __always_inline void set_errcode(struct aoe_datahdr *dh, int errcode)
+static void tree_async_exit(void)
 {
-    memcpy(dh->data, &errcode, sizeof(int));
+    if (node_read_async)
+        symbol_put(clydefscore_node_read_async);
+    if (node_write_async)
+        symbol_put(clydefscore_node_write_async);
+    if (node_insert_async)
+        symbol_put(clydefscore_node_insert_async);
+}
+
+/**
+ * Completion for tree_async: finish the reply op the way treeop would.
+ */
+static void tree_async_done(void *priv, int err)
+{
+    struct tree_work *tw = priv;
+    struct sk_buff *skb = tw->rskb;
+    struct aoe_hdr *ah = (struct aoe_hdr *) skb_mac_header(skb);
+    struct aoe_treeh *th = (struct aoe_treeh *) ah->data;
+    struct aoe_treeop *r = (struct aoe_treeop *) th->data;
+    u32 len = be32_to_cpu(r->len);
+
+    switch (r->op) {
+    case TREEOP_READ:
+        if (err)
+            len = 0;
+        break;
+    case TREEOP_INSERT:
+        r->nid = cpu_to_be64(tw->nid);
+        if (!err)
+            treestat_add(tw->tid, 1, 0);
+        len = 0;
+        break;
+    case TREEOP_UPDATE:
+        if (!err)
+            treestat_add(tw->tid, 0, len);
+        len = 0;
+        break;
+    }
+    r->flags = 0;
+    r->err = cpu_to_be16((u16) err);
+    r->len = cpu_to_be32(len);
+    th->flags = 0;
+    skb_trim(skb, sizeof(*ah) + sizeof(*th) + sizeof(*r) + len);
+    trace_treeop(skb, r);
+    tree_work_done(tw, skb);
 }
 
+/**
+ * Hand a lone READ, UPDATE or INSERT to the backend's asynchronous
+ * calls, so the worker can go on to the next command instead of
+ * waiting.  The reply is built in place, as treeframe does for a
+ * single op.
+ * @return 1 if the command was submitted and tree_async_done will
+ *         finish it, 0 to run it synchronously
+ * @note the treeq still submits in arrival order and the backend
+ *       keeps that order per node.
+ */
+static int tree_async(struct tree_work *tw)
+{
+    struct sk_buff *skb = tw->rskb;
+    struct aoe_hdr *ah = (struct aoe_hdr *) skb_mac_header(skb);
+    struct aoe_treeh *th = (struct aoe_treeh *) ah->data;
+    struct aoe_treeop *q = (struct aoe_treeop *) th->data;
+    int room = skb->len - sizeof(*ah) - sizeof(*th);
+    int qroom = tw->rlen - (int) (sizeof(*ah) + sizeof(*th));
+    u32 len, off;
+    int err;
+
+    if (ah->cmd != AOECMD_TREE || qroom < (int) sizeof(*q))
+        return 0;
+    if (th->ver != TREE_VER || be16_to_cpu(th->nops) != 1 || qroom < treeop_size(q))
+        return 0;
+
+    /*compressed payloads take the synchronous path*/
+    if (q->flags & TREEOPFL_LZ4)
+        return 0;
+    len = be32_to_cpu(q->len);
+    off = be32_to_cpu(q->off);
+    tw->tid = be64_to_cpu(q->tid);
+    tw->nid = be64_to_cpu(q->nid);
+
+    switch (q->op) {
+    case TREEOP_READ:
+        if (!node_read_async || len > room - sizeof(*q))
+            return 0;
+        err = node_read_async(tw->tid, tw->nid, off, len, q->data, tree_async_done, tw);
+        break;
+    case TREEOP_UPDATE:
+        if (!node_write_async)
+            return 0;
+        err = node_write_async(tw->tid, tw->nid, off, len, q->data, tree_async_done, tw);
+        break;
+    case TREEOP_INSERT:
+        if (!node_insert_async)
+            return 0;
+        err = node_insert_async(tw->tid, &tw->nid, tree_async_done, tw);
+        break;
+    default:
+        return 0;
+    }
+    return err == 0;
+}
 
-static struct sk_buff *treecmd(struct aoedev *d, struct sk_buff *skb)
+static struct sk_buff *treecmd(struct aoedev *d, struct sk_buff *skb, int rlen)
 {
     struct aoe_hdr *ah;
     struct aoe_datahdr *dh;
     u64 tree_ret;
+    u64 room, qroom;
+    int k;
 
     ah = (struct aoe_hdr *) skb_mac_header(skb);
 	dh = (struct aoe_datahdr *) ah->data;
+    room = skb->len - sizeof(*ah) - sizeof(*dh);
+    /*the data that came with the request, skb is as long as the MTU*/
+    qroom = max_t(int, rlen - sizeof(*ah) - sizeof(*dh), 0);
+
+    if (ah->cmd == AOECMD_TREE)
+        return treeframe(d, skb, rlen);
 
     /*__dbg_print_treecmd(INCOMING,ah,dh);*/
 
     switch(ah->cmd) {
     case AOECMD_CREATETREE:
-        /*FIXME: guard against retval==0 which indicates a failure to make a tree*/
-        tree_ret = clydefscore_tree_create(10);
+        /*len, if set, is the k-value the client wants*/
+        k = (dh->tree.len && dh->tree.len <= TREE_KMAX) ? dh->tree.len : d->tree_k;
+        tree_ret = clydefscore_tree_create(k);
         if(likely(tree_ret)){ /*success*/
+            treestat_create(tree_ret, k);
             dh->tree.tid = tree_ret;
             dh->tree.err = 0;
         } else {
@@ -889,11 +4149,20 @@ static struct sk_buff *treecmd(struct aoedev *d, struct sk_buff *skb)
         break;
     case AOECMD_REMOVETREE:
         dh->tree.err = clydefscore_tree_remove(dh->tree.tid);
+        if (!dh->tree.err)
+            treestat_remove(dh->tree.tid);
         skb_trim(skb, sizeof(*ah) + sizeof(*dh));
         break;
     case AOECMD_UPDATENODE:
         pdbg("AOECMD_UPDATENODE: writing %llu bytes of data at offset(%llu)\n", dh->tree.len, dh->tree.off);
+        if (unlikely(dh->tree.len > qroom)) {
+            dh->tree.err = -EMSGSIZE;
+            skb_trim(skb, sizeof(*ah) + sizeof(*dh));
+            break;
+        }
         dh->tree.err = clydefscore_node_write(dh->tree.tid, dh->tree.nid, dh->tree.off, dh->tree.len, dh->data);
+        if (!dh->tree.err)
+            treestat_add(dh->tree.tid, 0, dh->tree.len);
         pdbg("data written:\n");
 #ifdef DEBUGGING
         print_hex_dump(KERN_EMERG, "", DUMP_PREFIX_NONE, 16, 1, dh->data, dh->tree.len, 0);
@@ -902,22 +4171,30 @@ static struct sk_buff *treecmd(struct aoedev *d, struct sk_buff *skb)
         break;
     case AOECMD_INSERTNODE:
         dh->tree.err = clydefscore_node_insert(dh->tree.tid, &dh->tree.nid);
+        if (!dh->tree.err)
+            treestat_add(dh->tree.tid, 1, 0);
         skb_trim(skb, sizeof(*ah) + sizeof(*dh));
         break;
     case AOECMD_READNODE:
         pdbg("AOECMD_READNODE: reading %llu(uint:%u) bytes of data at offset(%llu)\n", dh->tree.len, (dh->tree.len & 0xFFFFFFFF), dh->tree.off);
+        /*the reply has to fit the frame; this also keeps len within 32 bits*/
+        if (unlikely(dh->tree.len > room)) {
+            dh->tree.err = -EMSGSIZE;
+            skb_trim(skb, sizeof(*ah) + sizeof(*dh));
+            break;
+        }
         dh->tree.err = clydefscore_node_read(dh->tree.tid, dh->tree.nid, dh->tree.off, dh->tree.len, dh->data);
         if (unlikely(dh->tree.err)) {
             pdbg("\t\t AOECMD_READNODE err'ed out!\n");
             skb_trim(skb, sizeof(*ah) + sizeof(*dh)); /*no additional data on error*/
         } else {
-            /*dh->tree.len -- cannot use u64 across our ethernet interface 
-              anyway, but it's technically breaking the interface*/
-            skb_trim(skb, sizeof(*ah) + sizeof(*dh) + (dh->tree.len & 0xFFFFFFFF));
+            skb_trim(skb, sizeof(*ah) + sizeof(*dh) + dh->tree.len);
         }
         break;
     case AOECMD_REMOVENODE:
         dh->tree.err = clydefscore_node_remove(dh->tree.tid, dh->tree.nid);
+        if (!dh->tree.err)
+            treestat_add(dh->tree.tid, -1, 0);
         skb_trim(skb, sizeof(*ah) + sizeof(*dh));
         break;
     default:
@@ -925,6 +4202,7 @@ static struct sk_buff *treecmd(struct aoedev *d, struct sk_buff *skb)
         return NULL; /*FIXME: always dropping now*/
     }
     /*__dbg_print_treecmd(OUTGOING, ah, dh);*/
+    trace_kvblade_treeop(skb, ah->cmd, dh->tree.tid, dh->tree.nid, dh->tree.len, dh->tree.err);
     
     return skb;
 }
@@ -949,6 +4227,169 @@ static struct sk_buff* make_response(struct sk_buff *skb, int major, int minor)
 	return rskb;
 }
 
+/* what serving the frame puts on the wire; a read costs its reply */
+static int frame_cost(struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoe_datahdr *dh = (struct aoe_datahdr *) aoe->data;
+	int n = skb->len;
+
+	if (aoe->cmd == AOECMD_ATA && n >= sizeof *aoe + sizeof dh->ata)
+		n = max_t(int, n, sizeof *aoe + sizeof *dh + (dh->ata.scnt << 9));
+	return n;
+}
+
+static int tb_ready(struct tbucket *tb)
+{
+	unsigned long elapsed;
+	s64 add, burst;
+
+	if (tb->rate == 0)
+		return 1;
+	elapsed = min_t(unsigned long, jiffies - tb->stamp, HZ);
+	add = div_u64(tb->rate * elapsed, HZ);
+	if (add) {
+		/* allow up to 100ms worth of burst */
+		burst = max_t(s64, div_u64(tb->rate, 10), 1);
+		tb->tokens = min(tb->tokens + add, burst);
+		tb->stamp = jiffies;
+	}
+	return tb->tokens > 0;
+}
+
+/* 
+ * Charge the frame against the rate limits of the target it addresses.
+ * Tokens may go negative, which keeps a frame bigger than the burst from
+ * waiting forever.  Called under fq_lock.
+ */
+static int tb_admit(struct sk_buff *skb, int cost)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoedev *d;
+	int major, minor, ok = 1;
+
+	major = be16_to_cpu(aoe->major);
+	minor = aoe->minor;
+	if (aoe->cmd == AOECMD_CFG || major == 0xffff || minor == 0xff)
+		return 1;
+
+	spin_lock(&lock);
+	for (d = devlist; d; d = d->next)
+		if (d->major == major && d->minor == minor && kvblade_path(d, skb->dev))
+			break;
+	if (d) {
+		ok = tb_ready(&d->iops) && tb_ready(&d->bw);
+		if (ok) {
+			if (d->iops.rate)
+				d->iops.tokens--;
+			if (d->bw.rate)
+				d->bw.tokens -= cost;
+		}
+	}
+	spin_unlock(&lock);
+	return ok;
+}
+
+/*
+ * The inbound queues are bounded: past half of inq_max frames in all,
+ * arrivals are dropped with a probability that grows to certainty at
+ * inq_max, and no one queue holds more than FQ_FLOWMAX.  Dropping early
+ * and a little at a time keeps latency down and sheds load before
+ * initiators start timing out and retransmitting.
+ */
+static int inq_max = 4096;
+module_param(inq_max, int, 0644);
+MODULE_PARM_DESC(inq_max, "most frames waiting to be served before arrivals are dropped");
+
+static int fq_len;	/* frames in all flows, under fq_lock */
+
+/* queue skb, or return -EBUSY and leave it to the caller */
+static int fq_enqueue(struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoeflow *f;
+	int lim = max(inq_max, 2);
+	u32 h;
+
+	h = jhash(aoe->src, ETH_ALEN, be16_to_cpu(aoe->major) << 8 | aoe->minor);
+	f = &flows[(h ^ skb->dev->ifindex) & (NFLOWS-1)];
+
+	spin_lock_bh(&fq_lock);
+	if (fq_len >= lim || skb_queue_len(&f->q) >= FQ_FLOWMAX ||
+		(fq_len > lim / 2 &&
+		prandom_u32() % (lim - lim / 2) < fq_len - lim / 2)) {
+		spin_unlock_bh(&fq_lock);
+		return -EBUSY;
+	}
+	fq_len++;
+	if (skb_queue_empty(&f->q)) {
+		f->deficit = FQ_QUANTUM;
+		list_add_tail(&f->active, &fq_active);
+	}
+	__skb_queue_tail(&f->q, skb);
+	spin_unlock_bh(&fq_lock);
+	return 0;
+}
+
+/*
+ * Pick the next frame to serve.  Flows whose target is over its limits
+ * are passed over; *throttled is set when only those are left so that
+ * the caller can nap until the buckets refill.
+ */
+static struct sk_buff *fq_dequeue(int *throttled)
+{
+	struct aoeflow *f, *first = NULL;
+	struct sk_buff *skb;
+	int cost;
+
+	*throttled = 0;
+	spin_lock_bh(&fq_lock);
+	while (!list_empty(&fq_active)) {
+		f = list_first_entry(&fq_active, struct aoeflow, active);
+		if (f == first) {
+			*throttled = 1;
+			break;
+		}
+		skb = skb_peek(&f->q);
+		cost = frame_cost(skb);
+		if (f->deficit < cost) {
+			f->deficit += FQ_QUANTUM;
+			list_move_tail(&f->active, &fq_active);
+			first = NULL;
+			continue;
+		}
+		if (!tb_admit(skb, cost)) {
+			if (first == NULL)
+				first = f;
+			list_move_tail(&f->active, &fq_active);
+			continue;
+		}
+		__skb_unlink(skb, &f->q);
+		fq_len--;
+		f->deficit -= cost;
+		if (skb_queue_empty(&f->q))
+			list_del_init(&f->active);
+		spin_unlock_bh(&fq_lock);
+		return skb;
+	}
+	spin_unlock_bh(&fq_lock);
+	return NULL;
+}
+
+static void fq_purge(void)
+{
+	struct aoeflow *f;
+
+	spin_lock_bh(&fq_lock);
+	for (f = flows; f < flows + nelem(flows); f++) {
+		__skb_queue_purge(&f->q);
+		INIT_LIST_HEAD(&f->active);
+	}
+	INIT_LIST_HEAD(&fq_active);
+	fq_len = 0;
+	spin_unlock_bh(&fq_lock);
+}
+
 static int rcv(struct sk_buff *skb, struct net_device *ndev, struct packet_type *pt, struct net_device *orig_dev)
 {
 	struct aoe_hdr *aoe;
@@ -965,8 +4406,13 @@ static int rcv(struct sk_buff *skb, struct net_device *ndev, struct packet_type
 
 	aoe = (struct aoe_hdr *) skb_mac_header(skb);
 	if (~aoe->verfl & AOEFL_RSP) {
-		skb_queue_tail(&skb_inq, skb);
-		wake_up(&ktwaitq);
+		stat_inc(STAT_RX);
+		trace_kvblade_rcv(skb);
+		if (fq_enqueue(skb) < 0) {
+			stat_inc(STAT_QDROP);
+			dev_kfree_skb(skb);
+		} else
+			wake_up(&ktwaitq);
 	} else {
 		dev_kfree_skb(skb);
 	}
@@ -981,6 +4427,115 @@ static __always_inline int is_tree_cmd(unsigned char cmd)
 }
 
 
+/*
+ * A broadcast CFG query can match every target we have.  Answering it
+ * inline would hold up I/O behind hundreds of responses, so the kthread
+ * hands such queries to cfg_work, which answers from each target's cached
+ * response and lets the answers out CFG_BURST per jiffy.  A query that
+ * repeats one still waiting is dropped.
+ */
+static struct sk_buff_head cfg_q;	/* broadcast queries waiting */
+static struct sk_buff_head cfg_outq;	/* responses waiting to go out */
+
+static void cfg_work(struct work_struct *w);
+static DECLARE_DELAYED_WORK(cfg_dwork, cfg_work);
+
+static void cfg_defer(struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoe_hdr *q;
+	struct sk_buff *o;
+	ulong flags;
+
+	if (skb->len < sizeof *aoe + sizeof (struct aoe_cfghdr)) {
+		dev_kfree_skb(skb);
+		return;
+	}
+	spin_lock_irqsave(&cfg_q.lock, flags);
+	skb_queue_walk(&cfg_q, o) {
+		q = (struct aoe_hdr *) skb_mac_header(o);
+		if (o->dev == skb->dev && o->len == skb->len &&
+			memcmp(q->src, aoe->src, ETH_ALEN) == 0 &&
+			q->major == aoe->major && q->minor == aoe->minor &&
+			memcmp(q->data, aoe->data, skb->len - sizeof *aoe) == 0) {
+			spin_unlock_irqrestore(&cfg_q.lock, flags);
+			dev_kfree_skb(skb);
+			return;
+		}
+	}
+	__skb_queue_tail(&cfg_q, skb);
+	spin_unlock_irqrestore(&cfg_q.lock, flags);
+	schedule_delayed_work(&cfg_dwork, 0);
+}
+
+static void cfg_broadcast(struct sk_buff *skb)
+{
+	struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+	struct aoe_cfghdr *cfgh = (struct aoe_cfghdr *) aoe->data;
+	struct sk_buff *rskb;
+	struct aoedev *d;
+	struct aoepath *p;
+	int major, minor, cslen, ccmd;
+
+	major = be16_to_cpu(aoe->major);
+	minor = aoe->minor;
+	cslen = ntohs(cfgh->cslen);
+	ccmd = cfgh->aoeccmd & 0xf;
+	/* the string is compared in place, so it must all have come */
+	if (cslen > sizeof d->config || sizeof *aoe + sizeof *cfgh + cslen > skb->len)
+		return;
+
+	spin_lock(&lock);
+	for (d=devlist; d; d=d->next) {
+		if ((major != d->major && major != 0xffff) ||
+			(minor != d->minor && minor != 0xff) ||
+			(p = kvblade_path(d, skb->dev)) == NULL)
+			continue;
+
+		stat_inc(STAT_CFG);
+		switch (ccmd) {
+		case AOECCMD_TEST:
+			if (d->nconfig != cslen)
+				continue;
+			// fall thru
+		case AOECCMD_PTEST:
+			if (cslen > d->nconfig)
+				continue;
+			if (memcmp(cfgh->data, d->config, cslen) != 0)
+				continue;
+			// fall thru
+		case AOECCMD_READ:
+			rskb = cfg_cached(d, p, aoe);
+			break;
+		default:
+			rskb = make_response(skb, d->major, d->minor);
+			if (rskb)
+				rskb = cfg(d, rskb);
+			break;
+		}
+		if (rskb)
+			skb_queue_tail(&cfg_outq, rskb);
+	}
+	spin_unlock(&lock);
+}
+
+static void cfg_work(struct work_struct *w)
+{
+	struct sk_buff *skb;
+	int n;
+
+	while ((skb = skb_dequeue(&cfg_q))) {
+		cfg_broadcast(skb);
+		dev_kfree_skb(skb);
+	}
+	for (n = 0; n < CFG_BURST && (skb = skb_dequeue(&cfg_outq)); n++)
+		skb_queue_tail(&skb_outq, skb);
+	if (n)
+		wake_up(&ktwaitq);
+	if (!skb_queue_empty(&cfg_outq))
+		schedule_delayed_work(&cfg_dwork, 1);
+}
+
 static void ktrcv(struct sk_buff *skb)
 {
 	struct sk_buff *rskb;
@@ -989,30 +4544,56 @@ static void ktrcv(struct sk_buff *skb)
 	int major, minor;
     struct tree_work *tw;
 
+	capture(skb, KVCAP_RX);
 	aoe = (struct aoe_hdr *) skb_mac_header(skb);
 	major = be16_to_cpu(aoe->major);
 	minor = aoe->minor;
 
+	if (aoe->cmd == AOECMD_CFG && (major == 0xffff || minor == 0xff)) {
+		cfg_defer(skb);
+		return;
+	}
+
 	spin_lock(&lock);
 
 	for (d=devlist; d; d=d->next) {
 		if ((major != d->major && major != 0xffff) ||
 			(minor != d->minor && minor != 0xff) ||
-			(skb->dev != d->netdev))
+			kvblade_path(d, skb->dev) == NULL)
 			continue;
 
-        count_inc(&mycounter);
+		if (aoe->cmd != AOECMD_CFG)
+		switch (tag_begin(d, aoe->src, aoe->tag)) {
+		case TAG_INFLIGHT:
+			stat_inc(STAT_DUPDROP);
+			continue;
+		case TAG_REPLAYED:
+			stat_inc(STAT_REPLAY);
+			continue;
+		}
+
 		rskb = make_response(skb, d->major, d->minor);
-		if (rskb == NULL)
+		if (rskb == NULL) {
+			stat_inc(STAT_NOMEM);
+			if (aoe->cmd != AOECMD_CFG)
+				tag_cancel(d, aoe->src, aoe->tag);
 			continue;
+		}
+		trace_kvblade_dispatch(rskb);
 
 		switch (aoe->cmd) {
 		case AOECMD_ATA:
-			rskb = ata(d, rskb);
+			stat_inc(STAT_ATA);
+			rskb = ata(d, rskb, skb->len);
 			break;
 		case AOECMD_CFG:
+			stat_inc(STAT_CFG);
 			rskb = cfg(d, rskb);
 			break;
+		case AOECMD_COPY:
+			stat_inc(STAT_COPY);
+			rskb = copycmd(d, rskb);
+			break;
         /*TODO branch on vendor-specifc codes in a meaningful way*/
         case AOECMD_CREATETREE:
         case AOECMD_REMOVETREE:
@@ -1020,30 +4601,38 @@ static void ktrcv(struct sk_buff *skb)
         case AOECMD_INSERTNODE:
         case AOECMD_UPDATENODE:
         case AOECMD_REMOVENODE:
+        case AOECMD_TREE:
             pdbg(KERN_INFO "Received vendor-specific cmd: %u\n", aoe->cmd);
+            stat_inc(STAT_TREE);
             tw = kmem_cache_alloc(tw_pool, GFP_ATOMIC);
             if (!tw) {
                 printk("failed to allocate tree_work\n");
-                dev_kfree_skb(rskb);
+                stat_inc(STAT_NOMEM);
+                busy(d, rskb);
+                rskb = NULL;
                 break;            
             } else {
                 tw->rskb = rskb;
+                tw->rlen = skb->len;
                 tw->d = d;
-                PREPARE_WORK(&tw->work, do_tree_work);
                 rskb = NULL; /*nothing to return presently, async OP*/
                 atomic_inc(&tw->d->busy);
-                queue_work(tree_wq, &tw->work);
+                treeq_queue(tw);
             }
             
             
             break;
 		default:
+			tag_cancel(d, aoe->src, aoe->tag);
 			dev_kfree_skb(rskb);
 			continue;
 		}
 
-		if (rskb)
+		if (rskb) {
+			if (aoe->cmd != AOECMD_CFG)
+				tag_end(d, rskb);
 			skb_queue_tail(&skb_outq, rskb);
+		}
 	}
 
     
@@ -1055,6 +4644,7 @@ static void ktrcv(struct sk_buff *skb)
 static int kthread(void *errorparameternameomitted)
 {
 	struct sk_buff *iskb, *oskb;
+	int throttled;
 	DECLARE_WAITQUEUE(wait, current);
 	sigset_t blocked;
 
@@ -1069,14 +4659,17 @@ static int kthread(void *errorparameternameomitted)
 	do {
 		__set_current_state(TASK_RUNNING);
 		do {
-			if ((iskb = skb_dequeue(&skb_inq)))
+			if ((iskb = fq_dequeue(&throttled)))
 				ktrcv(iskb);
 			if ((oskb = skb_dequeue(&skb_outq)))
-				dev_queue_xmit(oskb);
+				kvblade_xmit(oskb);
 		} while (iskb || oskb);
 		set_current_state(TASK_INTERRUPTIBLE);
 		add_wait_queue(&ktwaitq, &wait);
-		schedule();
+		if (throttled)
+			schedule_timeout(1);
+		else
+			schedule();
 		remove_wait_queue(&ktwaitq, &wait);
 	} while (!kthread_should_stop());
 	__set_current_state(TASK_RUNNING);
@@ -1091,8 +4684,28 @@ static struct packet_type pt = {
 
 static int __init kvblade_module_init(void)
 {
+	int i;
+
+	/*framed tree commands share the vendor range with <linux/tree.h>*/
+	BUILD_BUG_ON((int) AOECMD_TREE >= (int) AOECMD_CREATETREE &&
+		(int) AOECMD_TREE <= (int) AOECMD_REMOVENODE);
+	BUILD_BUG_ON((int) AOECMD_COPY >= (int) AOECMD_CREATETREE &&
+		(int) AOECMD_COPY <= (int) AOECMD_REMOVENODE);
+	/*captured frames keep every command header whole*/
+	BUILD_BUG_ON(sizeof(struct aoe_hdr) + sizeof(struct aoe_datahdr) > KVCAP_SNAP);
+	BUILD_BUG_ON(sizeof(struct aoe_hdr) + sizeof(struct aoe_copyh) > KVCAP_SNAP);
+	BUILD_BUG_ON(sizeof(struct aoe_hdr) + sizeof(struct aoe_treeh) +
+		sizeof(struct aoe_treeop) > KVCAP_SNAP);
+
 	skb_queue_head_init(&skb_outq);
-	skb_queue_head_init(&skb_inq);
+	skb_queue_head_init(&cfg_q);
+	skb_queue_head_init(&cfg_outq);
+	for (i = 0; i < nelem(flows); i++) {
+		skb_queue_head_init(&flows[i].q);
+		INIT_LIST_HEAD(&flows[i].active);
+	}
+	spin_lock_init(&fq_lock);
+	xmitq_init();
     
 	
 	spin_lock_init(&lock);
@@ -1100,15 +4713,14 @@ static int __init kvblade_module_init(void)
 	init_completion(&ktrendez);
 	init_waitqueue_head(&ktwaitq);
     setup_timer( &tmr, tmr_cb, 0 );
-    if ( mod_timer(&tmr, jiffies + msecs_to_jiffies(10000)) ) {
-        printk("error initialising timer (mod_timer)\n");
-    }
+    mod_timer(&tmr, jiffies + HZ);
 
     tree_wq = alloc_workqueue("kvblade_treewq", 
                   WQ_HIGHPRI | WQ_CPU_INTENSIVE, 256);
     if (!tree_wq) {
         return -ENOMEM;
     }
+    treeq_init();
 
     tw_pool = kmem_cache_create(
         "kvblade_tw_pool",
@@ -1118,15 +4730,41 @@ static int __init kvblade_module_init(void)
 		SLAB_RECLAIM_ACCOUNT 
         /*spread allocation across memory rather than favouring memory local to current cpu*/
          | SLAB_MEM_SPREAD,  
-        /*called whenever new pages are added to the cache*/
-		tree_work_init_once
+		NULL
     );
 	if (!tw_pool) {
         pr_debug("Failed to allocate a memcache for tree work items\n");
         destroy_workqueue(tree_wq);
 		return -ENOMEM;
     }
-	
+
+	tag_pool = kmem_cache_create("kvblade_tag_pool", sizeof(struct aoetag), 0, 0, NULL);
+	if (!tag_pool) {
+		kmem_cache_destroy(tw_pool);
+		destroy_workqueue(tree_wq);
+		return -ENOMEM;
+	}
+
+	file_wq = alloc_workqueue("kvblade_filewq", WQ_UNBOUND, 0);
+	if (!file_wq) {
+		kmem_cache_destroy(tag_pool);
+		kmem_cache_destroy(tw_pool);
+		destroy_workqueue(tree_wq);
+		return -ENOMEM;
+	}
+
+	copy_wq = alloc_workqueue("kvblade_copywq", WQ_UNBOUND, NCOPIES);
+	if (!copy_wq) {
+		destroy_workqueue(file_wq);
+		kmem_cache_destroy(tag_pool);
+		kmem_cache_destroy(tw_pool);
+		destroy_workqueue(tree_wq);
+		return -ENOMEM;
+	}
+
+	tree_async_init();
+	treelz4_init();
+	capture_init();
 	task = kthread_run(kthread, NULL, "kvblade");
 	if (task == NULL || IS_ERR(task))
 		return -EAGAIN;
@@ -1137,6 +4775,7 @@ static int __init kvblade_module_init(void)
 	init_completion(&ktrendez);	// for exit
 
 	dev_add_pack(&pt);
+	schedule_delayed_work(&bufcnt_dwork, HZ);
 	return 0;
 }
 
@@ -1145,10 +4784,11 @@ static __exit void kvblade_module_exit(void)
 	struct aoedev *d, *nd;
 
 	printk("Testing exiting\n");
-    while ( del_timer(&tmr) ) {
-        printk("waiting for timer...\n");
-        msleep(3000);
-    }
+    /*tmr_cb re-arms itself, which del_timer_sync copes with*/
+    del_timer_sync(&tmr);
+
+    cancel_delayed_work_sync(&bufcnt_dwork);
+    cancel_delayed_work_sync(&announce_dwork);
 
     /*Finish outstanding work -- TODO - how does ata_io_complete fare in this regard*/
     flush_workqueue(tree_wq);
@@ -1160,23 +4800,34 @@ static __exit void kvblade_module_exit(void)
 	spin_unlock(&lock);
 	for (; d; d=nd) {
 		nd = d->next;
-		while (atomic_read(&d->busy))
-			msleep(100);
-		blkdev_put(d->blkdev, FMODE_READ|FMODE_WRITE);
-		
-		kobject_del(&d->kobj);
-		kobject_put(&d->kobj);
+		kvblade_drain(d);
 	}
+	mutex_lock(&ctl_mutex);
+	batch_abort();
+	mutex_unlock(&ctl_mutex);
+	/* their work queues replies, so it must be done before the purge */
+	destroy_workqueue(file_wq);
+	destroy_workqueue(copy_wq);
+	copy_purge();
 	kthread_stop(task);
 	wait_for_completion(&ktrendez);
+	cancel_delayed_work_sync(&cfg_dwork);
+	skb_queue_purge(&cfg_q);
+	skb_queue_purge(&cfg_outq);
 	skb_queue_purge(&skb_outq);
-	skb_queue_purge(&skb_inq);
+	xmitq_exit();
+	capture_exit();
+	fq_purge();
 	
 	kobject_del(&kvblade_kobj);
 	kobject_put(&kvblade_kobj);
     
     destroy_workqueue(tree_wq);
+    tree_async_exit();
+    treelz4_exit();
     kmem_cache_destroy(tw_pool);
+    kmem_cache_destroy(tag_pool);
+    treestat_purge();
     
 }
 
@@ -0,0 +1,48 @@
+/*
+ * The frame capture ring, shared between kvblade and kvreplay.
+ *
+ * With capture_records set at load, kvblade keeps the first KVCAP_SNAP
+ * bytes of every frame ktrcv handles and every reply it sends in a ring
+ * that /sys/kernel/debug/kvblade/capture maps read-only: a kvcap_hdr
+ * page, then nrec kvcap_recs.  Writing 1 to capture_on there starts
+ * recording, 0 stops it.
+ *
+ * The ring is lossy.  Writers never wait for the reader, and the oldest
+ * records are overwritten first.  Record i (from 0) goes in slot
+ * i % nrec and has seq i + 1 once it is complete.  seq is 0 while the
+ * record is being written, so a reader copies a record and then checks
+ * that seq did not change.
+ */
+#ifndef _KVBLADE_CAPTURE_H
+#define _KVBLADE_CAPTURE_H
+
+#include <linux/types.h>
+
+enum {
+	KVCAP_MAGIC = 0x6b766370,	/* "kvcp" */
+	KVCAP_VER = 2,
+	KVCAP_SNAP = 72,		/* aoe_hdr and aoe_copyh, the largest command header */
+
+	KVCAP_RX = 0,
+	KVCAP_TX,
+};
+
+struct kvcap_hdr {
+	__u32 magic;
+	__u32 ver;
+	__u32 nrec;		/* a power of two */
+	__u32 recsize;
+	__u64 head;		/* records written so far, roughly */
+};
+
+struct kvcap_rec {
+	__u64 seq;
+	__u64 ns;		/* CLOCK_MONOTONIC */
+	__u16 len;		/* of the whole frame */
+	__u8 dir;
+	__u8 caplen;
+	__u32 ifindex;
+	unsigned char data[KVCAP_SNAP];
+};
+
+#endif /* _KVBLADE_CAPTURE_H */
@@ -0,0 +1,158 @@
+/*
+ * Tracepoints along the life of a request:
+ *
+ *	kvblade_rcv		frame handed to us by the network stack
+ *	kvblade_dispatch	kthread matched it to a target
+ *	kvblade_ata_submit	bio sent to the backing device
+ *	kvblade_ata_complete	bio came back
+ *	kvblade_tree_start	tree work item started running
+ *	kvblade_treeop		one tree operation finished
+ *	kvblade_xmit		reply handed to dev_queue_xmit
+ *
+ * The frame events all carry the target and tag, so per-stage latency is
+ * a matter of joining on (major, minor, tag), e.g. with perf or bpftrace.
+ *
+ * struct aoe_hdr comes from if_aoe.h, which must be included first.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kvblade
+
+#if !defined(_KVBLADE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KVBLADE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(kvblade_frame,
+	TP_PROTO(struct sk_buff *skb),
+	TP_ARGS(skb),
+	TP_STRUCT__entry(
+		__field(u16, major)
+		__field(u8, minor)
+		__field(u8, cmd)
+		__field(u32, tag)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+
+		__entry->major = be16_to_cpu(aoe->major);
+		__entry->minor = aoe->minor;
+		__entry->cmd = aoe->cmd;
+		__entry->tag = be32_to_cpu(aoe->tag);
+		__entry->len = skb->len;
+	),
+	TP_printk("%u.%u cmd %u tag %08x len %u",
+		__entry->major, __entry->minor, __entry->cmd,
+		__entry->tag, __entry->len)
+);
+
+DEFINE_EVENT(kvblade_frame, kvblade_rcv,
+	TP_PROTO(struct sk_buff *skb),
+	TP_ARGS(skb)
+);
+
+DEFINE_EVENT(kvblade_frame, kvblade_dispatch,
+	TP_PROTO(struct sk_buff *skb),
+	TP_ARGS(skb)
+);
+
+DEFINE_EVENT(kvblade_frame, kvblade_tree_start,
+	TP_PROTO(struct sk_buff *skb),
+	TP_ARGS(skb)
+);
+
+DEFINE_EVENT(kvblade_frame, kvblade_xmit,
+	TP_PROTO(struct sk_buff *skb),
+	TP_ARGS(skb)
+);
+
+TRACE_EVENT(kvblade_ata_submit,
+	TP_PROTO(struct sk_buff *skb, u64 lba, int rw),
+	TP_ARGS(skb, lba, rw),
+	TP_STRUCT__entry(
+		__field(u16, major)
+		__field(u8, minor)
+		__field(u8, ata)
+		__field(u32, tag)
+		__field(u64, lba)
+		__field(u8, scnt)
+		__field(int, rw)
+	),
+	TP_fast_assign(
+		struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+		struct aoe_atahdr *ata = (struct aoe_atahdr *) aoe->data;
+
+		__entry->major = be16_to_cpu(aoe->major);
+		__entry->minor = aoe->minor;
+		__entry->ata = ata->cmdstat;
+		__entry->tag = be32_to_cpu(aoe->tag);
+		__entry->lba = lba;
+		__entry->scnt = ata->scnt;
+		__entry->rw = rw;
+	),
+	TP_printk("%u.%u tag %08x ata 0x%02x %s lba %llu scnt %u",
+		__entry->major, __entry->minor, __entry->tag, __entry->ata,
+		__entry->rw ? "write" : "read", __entry->lba, __entry->scnt)
+);
+
+TRACE_EVENT(kvblade_ata_complete,
+	TP_PROTO(struct sk_buff *skb, int error),
+	TP_ARGS(skb, error),
+	TP_STRUCT__entry(
+		__field(u16, major)
+		__field(u8, minor)
+		__field(u32, tag)
+		__field(int, error)
+	),
+	TP_fast_assign(
+		struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+
+		__entry->major = be16_to_cpu(aoe->major);
+		__entry->minor = aoe->minor;
+		__entry->tag = be32_to_cpu(aoe->tag);
+		__entry->error = error;
+	),
+	TP_printk("%u.%u tag %08x error %d",
+		__entry->major, __entry->minor, __entry->tag, __entry->error)
+);
+
+TRACE_EVENT(kvblade_treeop,
+	TP_PROTO(struct sk_buff *skb, u8 op, u64 tid, u64 nid, u64 len, int err),
+	TP_ARGS(skb, op, tid, nid, len, err),
+	TP_STRUCT__entry(
+		__field(u16, major)
+		__field(u8, minor)
+		__field(u8, cmd)
+		__field(u8, op)
+		__field(u32, tag)
+		__field(u64, tid)
+		__field(u64, nid)
+		__field(u64, len)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		struct aoe_hdr *aoe = (struct aoe_hdr *) skb_mac_header(skb);
+
+		__entry->major = be16_to_cpu(aoe->major);
+		__entry->minor = aoe->minor;
+		__entry->cmd = aoe->cmd;
+		__entry->op = op;
+		__entry->tag = be32_to_cpu(aoe->tag);
+		__entry->tid = tid;
+		__entry->nid = nid;
+		__entry->len = len;
+		__entry->err = err;
+	),
+	TP_printk("%u.%u tag %08x cmd %u op %u tid %llu nid %llu len %llu err %d",
+		__entry->major, __entry->minor, __entry->tag, __entry->cmd,
+		__entry->op, __entry->tid, __entry->nid, __entry->len,
+		__entry->err)
+);
+
+#endif /* _KVBLADE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE kvblade_trace
+#include <trace/define_trace.h>
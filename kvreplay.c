@@ -0,0 +1,450 @@
+/*
+ * kvreplay: save kvblade's frame capture ring and play it back.
+ *
+ *	kvreplay save [ring] >file
+ *	kvreplay play [-s speed] [-t major.minor] [-d mac] [-w secs] ifname file
+ *
+ * save copies what the ring holds, oldest first, as a kvcap_hdr and
+ * its records.  play sends the captured requests out of ifname, towards
+ * a test kvblade on the other end of e.g. a veth pair, keeping their
+ * original spacing divided by speed.  When it is done it compares each
+ * kind of command's latency on the test target with what the capture
+ * saw.  Only headers are captured, so write data goes out as zeros.
+ * Never point play at a target whose data matters.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+#include "if_aoe.h"
+#include "kvblade_capture.h"
+
+enum {
+	MAXFRAME = ETH_HLEN + 9000,	/* jumbo */
+};
+
+enum {
+	C_READ,
+	C_WRITE,
+	C_ATA,
+	C_CFG,
+	C_TREE,
+	C_COPY,
+	C_OTHER,
+	NCLASS,
+};
+
+static char *classnames[NCLASS] = {
+	[C_READ] = "read",
+	[C_WRITE] = "write",
+	[C_ATA] = "ata",
+	[C_CFG] = "cfg",
+	[C_TREE] = "tree",
+	[C_COPY] = "copy",
+	[C_OTHER] = "other",
+};
+
+struct lat {
+	double *us;
+	int n, max;
+};
+
+static struct lat orig[NCLASS], replay[NCLASS];
+static int sent[NCLASS];
+static u32 nanswered;
+
+static char *argv0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s save [ring] >file\n", argv0);
+	fprintf(stderr, "       %s play [-s speed] [-t major.minor] [-d mac] [-w secs] ifname file\n", argv0);
+	exit(1);
+}
+
+static void
+fatal(char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void
+addlat(struct lat *l, double us)
+{
+	if (l->n == l->max) {
+		l->max = l->max ? 2 * l->max : 1024;
+		l->us = realloc(l->us, l->max * sizeof *l->us);
+		if (l->us == NULL)
+			fatal("realloc");
+	}
+	l->us[l->n++] = us;
+}
+
+static u64
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+classify(struct aoe_hdr *h, int len)
+{
+	struct aoe_atahdr *ata = (struct aoe_atahdr *) h->data;
+
+	switch (h->cmd) {
+	case AOECMD_ATA:
+		if (len < (int) (sizeof *h + sizeof *ata))
+			return C_ATA;
+		switch (ata->cmdstat) {
+		case 0x20:	/* READ SECTORS */
+		case 0x24:	/* READ SECTORS EXT */
+			return C_READ;
+		case 0x30:	/* WRITE SECTORS */
+		case 0x34:	/* WRITE SECTORS EXT */
+		case 0x3d:	/* WRITE DMA FUA EXT */
+		case 0xce:	/* WRITE MULTIPLE FUA EXT */
+			return C_WRITE;
+		}
+		return C_ATA;
+	case AOECMD_CFG:
+		return C_CFG;
+	case AOECMD_TREE:
+		return C_TREE;
+	case AOECMD_COPY:
+		return C_COPY;
+	}
+	return C_OTHER;
+}
+
+static int
+bysq(const void *a, const void *b)
+{
+	const struct kvcap_rec *x = a, *y = b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* copy the complete records out of the ring, oldest first */
+static int
+save(char *ring)
+{
+	struct kvcap_hdr *hdr, h;
+	struct kvcap_rec *recs, *out, r;
+	size_t size;
+	u32 i, n;
+	int fd;
+
+	fd = open(ring, O_RDONLY);
+	if (fd < 0)
+		fatal(ring);
+	hdr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		fatal("mmap");
+	if (hdr->magic != KVCAP_MAGIC || hdr->ver != KVCAP_VER || hdr->recsize != sizeof r) {
+		fprintf(stderr, "%s: not a capture ring this kvreplay understands\n", ring);
+		return 1;
+	}
+	size = getpagesize() + (size_t) hdr->nrec * sizeof r;
+	hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		fatal("mmap");
+	recs = (struct kvcap_rec *) ((char *) hdr + getpagesize());
+
+	out = malloc(hdr->nrec * sizeof *out);
+	if (out == NULL)
+		fatal("malloc");
+	for (i = n = 0; i < hdr->nrec; i++) {
+		r = recs[i];
+		__sync_synchronize();
+		if (r.seq == 0 || r.seq != recs[i].seq)
+			continue;
+		out[n++] = r;
+	}
+	qsort(out, n, sizeof *out, bysq);
+
+	h = *hdr;
+	h.nrec = n;
+	h.head = n;
+	if (fwrite(&h, sizeof h, 1, stdout) != 1 ||
+	    fwrite(out, sizeof *out, n, stdout) != n)
+		fatal("write");
+	fprintf(stderr, "%u frames saved\n", n);
+	return 0;
+}
+
+static struct kvcap_rec *
+load(char *file, u32 *n)
+{
+	struct kvcap_hdr h;
+	struct kvcap_rec *recs;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		fatal(file);
+	if (fread(&h, sizeof h, 1, f) != 1 || h.magic != KVCAP_MAGIC ||
+	    h.ver != KVCAP_VER || h.recsize != sizeof *recs) {
+		fprintf(stderr, "%s: not a kvreplay capture\n", file);
+		exit(1);
+	}
+	recs = malloc((h.nrec + 1) * sizeof *recs);
+	if (recs == NULL)
+		fatal("malloc");
+	if (fread(recs, sizeof *recs, h.nrec, f) != h.nrec) {
+		fprintf(stderr, "%s: short capture\n", file);
+		exit(1);
+	}
+	fclose(f);
+	*n = h.nrec;
+	return recs;
+}
+
+/* what the target took to answer each request in the capture */
+static void
+origlat(struct kvcap_rec *recs, u32 n)
+{
+	struct aoe_hdr *q, *r;
+	u32 i, j;
+
+	for (i = 0; i < n; i++) {
+		if (recs[i].dir != KVCAP_RX || recs[i].caplen < sizeof *q)
+			continue;
+		q = (struct aoe_hdr *) recs[i].data;
+		/* a frame's reply comes soon; don't search the whole capture */
+		for (j = i + 1; j < n && j < i + 65536; j++) {
+			r = (struct aoe_hdr *) recs[j].data;
+			if (recs[j].dir != KVCAP_TX || recs[j].caplen < sizeof *r)
+				continue;
+			if (r->tag == q->tag && memcmp(r->dst, q->src, ETH_ALEN) == 0) {
+				addlat(&orig[classify(q, recs[i].caplen)],
+					(recs[j].ns - recs[i].ns) / 1000.0);
+				break;
+			}
+		}
+	}
+}
+
+struct inflight {
+	u64 sent;
+	int class;
+	int answered;
+};
+
+static void
+reap(int s, struct inflight *fl, u32 nfl, int timeout)
+{
+	unsigned char buf[MAXFRAME];
+	struct aoe_hdr *h = (struct aoe_hdr *) buf;
+	struct pollfd p = { s, POLLIN, 0 };
+	u32 tag;
+	int len;
+
+	while (poll(&p, 1, timeout) > 0) {
+		len = recv(s, buf, sizeof buf, MSG_DONTWAIT);
+		if (len < (int) sizeof *h || !(h->verfl & AOEFL_RSP))
+			continue;
+		tag = ntohl(h->tag);
+		if (tag >= nfl || fl[tag].answered)
+			continue;
+		fl[tag].answered = 1;
+		nanswered++;
+		addlat(&replay[fl[tag].class], (now() - fl[tag].sent) / 1000.0);
+		timeout = 0;
+	}
+}
+
+static int
+play(char *ifname, char *file, double speed, int major, int minor,
+	unsigned char *dst, int wait)
+{
+	struct kvcap_rec *recs;
+	struct inflight *fl;
+	struct sockaddr_ll sa;
+	struct ifreq ifr;
+	unsigned char frame[MAXFRAME];
+	unsigned char mac[ETH_ALEN];
+	struct aoe_hdr *h = (struct aoe_hdr *) frame;
+	u64 t0, c0, due, t, deadline;
+	u32 i, n, nfl = 0;
+	int s, len, mtu;
+
+	recs = load(file, &n);
+	origlat(recs, n);
+
+	s = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_AOE));
+	if (s < 0)
+		fatal("socket");
+	memset(&ifr, 0, sizeof ifr);
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+	if (ioctl(s, SIOCGIFINDEX, &ifr) < 0)
+		fatal(ifname);
+	memset(&sa, 0, sizeof sa);
+	sa.sll_family = AF_PACKET;
+	sa.sll_protocol = htons(ETH_P_AOE);
+	sa.sll_ifindex = ifr.ifr_ifindex;
+	if (bind(s, (struct sockaddr *) &sa, sizeof sa) < 0)
+		fatal("bind");
+	if (ioctl(s, SIOCGIFHWADDR, &ifr) < 0)
+		fatal(ifname);
+	memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	if (ioctl(s, SIOCGIFMTU, &ifr) < 0)
+		fatal(ifname);
+	mtu = ifr.ifr_mtu;
+
+	fl = calloc(n, sizeof *fl);
+	if (fl == NULL)
+		fatal("calloc");
+
+	t0 = now();
+	c0 = 0;
+	for (i = 0; i < n; i++) {
+		if (recs[i].dir != KVCAP_RX || recs[i].caplen < sizeof *h)
+			continue;
+		if (c0 == 0)
+			c0 = recs[i].ns;
+		due = t0 + (u64) ((recs[i].ns - c0) / speed);
+		while ((t = now()) < due)
+			reap(s, fl, nfl, (due - t) / 1000000);
+
+		len = recs[i].len;
+		if (len > ETH_HLEN + mtu)
+			len = ETH_HLEN + mtu;
+		if (len > (int) sizeof frame)
+			len = sizeof frame;
+		memset(frame, 0, len);
+		memcpy(frame, recs[i].data, recs[i].caplen < len ? recs[i].caplen : len);
+		memcpy(h->dst, dst, ETH_ALEN);
+		memcpy(h->src, mac, ETH_ALEN);
+		if (major >= 0) {
+			h->major = htons(major);
+			h->minor = minor;
+		}
+		/* our own tags, so replies can't be confused */
+		h->tag = htonl(nfl);
+		fl[nfl].class = classify(h, len);
+		fl[nfl].sent = now();
+		if (send(s, frame, len, 0) != len)
+			fatal("send");
+		sent[fl[nfl].class]++;
+		nfl++;
+	}
+	deadline = now() + wait * 1000000000ULL;
+	while (nanswered < nfl && (t = now()) < deadline)
+		reap(s, fl, nfl, (deadline - t) / 1000000);
+	return 0;
+}
+
+static int
+bydouble(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+summary(struct lat *l, char *buf, size_t n)
+{
+	double sum = 0;
+	int i;
+
+	if (l->n == 0) {
+		snprintf(buf, n, "%10s %10s %10s", "-", "-", "-");
+		return;
+	}
+	qsort(l->us, l->n, sizeof *l->us, bydouble);
+	for (i = 0; i < l->n; i++)
+		sum += l->us[i];
+	snprintf(buf, n, "%10.1f %10.1f %10.1f",
+		sum / l->n, l->us[l->n / 2], l->us[l->n * 99 / 100]);
+}
+
+static void
+report(void)
+{
+	char o[64], r[64];
+	int i;
+
+	printf("%-6s %7s %7s  %32s  %32s\n", "", "sent", "lost",
+		"captured us: mean p50 p99", "replayed us: mean p50 p99");
+	for (i = 0; i < NCLASS; i++) {
+		if (sent[i] == 0 && orig[i].n == 0)
+			continue;
+		summary(&orig[i], o, sizeof o);
+		summary(&replay[i], r, sizeof r);
+		printf("%-6s %7d %7d  %s  %s\n", classnames[i], sent[i],
+			sent[i] - replay[i].n, o, r);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char dst[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	double speed = 1;
+	int major = -1, minor = 0, wait = 2, c;
+	unsigned int m[ETH_ALEN];
+
+	argv0 = argv[0];
+	if (argc < 2)
+		usage();
+	if (strcmp(argv[1], "save") == 0) {
+		if (argc > 3)
+			usage();
+		return save(argc == 3 ? argv[2] : "/sys/kernel/debug/kvblade/capture");
+	}
+	if (strcmp(argv[1], "play") != 0)
+		usage();
+
+	argv++;
+	argc--;
+	while ((c = getopt(argc, argv, "s:t:d:w:")) != -1)
+		switch (c) {
+		case 's':
+			speed = atof(optarg);
+			if (speed <= 0)
+				usage();
+			break;
+		case 't':
+			if (sscanf(optarg, "%d.%d", &major, &minor) != 2)
+				usage();
+			break;
+		case 'd':
+			if (sscanf(optarg, "%x:%x:%x:%x:%x:%x",
+			    &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6)
+				usage();
+			for (c = 0; c < ETH_ALEN; c++)
+				dst[c] = m[c];
+			break;
+		case 'w':
+			wait = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	if (argc - optind != 2)
+		usage();
+	play(argv[optind], argv[optind+1], speed, major, minor, dst, wait);
+	report();
+	return 0;
+}